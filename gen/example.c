@@ -0,0 +1,17 @@
+#include <stdio.h>
+
+#include "example.h"
+
+int
+main(void)
+{
+    struct shape s = { "triangle", { { 0, 0 }, { 1, 0 }, { 0, 1.5 } }, 1,
+                       { 3, 4 }, NULL };
+    char buf[256];
+    jsonb b;
+
+    jsonb_init(&b);
+    if (shape_to_json(&b, buf, sizeof(buf), &s) != JSONB_END) return 1;
+    puts(buf);
+    return 0;
+}
@@ -0,0 +1,402 @@
+/*
+ * Generate json-build serializers for the structs described by an IDL.
+ *
+ * Usage:
+ * $ ./jsonb-gen < example.idl > example.h
+ *
+ * The IDL is a list of struct declarations, where every field has one of the
+ * types int, long, unsigned, double, bool, string (a NUL-terminated
+ * `const char *`, NULL for null) or a previously declared struct, can be a
+ * fixed-size array, and can be given a JSON key that differs from its name
+ * (a string that takes JSON's escapes, except for \u):
+ *
+ * # comment
+ * struct point {
+ *     double x;
+ *     double y;
+ * }
+ * struct shape {
+ *     string name;
+ *     struct point vertices[3];
+ *     bool closed "is-closed";
+ * }
+ *
+ * For every struct, the output declares the struct along with
+ * `jsonbcode <name>_to_json(jsonb *b, char buf[], size_t bufsize,
+ * const struct <name> *v)`, whose keys are escaped at generation time and
+ * merged with the braces and brackets around them into runs that are each
+ * written by a single jsonb_run() call.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_INPUT   (1 << 16)
+#define MAX_STRUCTS 64
+#define MAX_FIELDS  64
+#define MAX_NAME    64
+#define MAX_KEY     256
+
+enum token { T_EOF, T_IDENT, T_NUMBER, T_STRING, T_PUNCT };
+
+struct field {
+    char name[MAX_NAME];
+    /* JSON key, already escaped */
+    char key[MAX_KEY];
+    size_t keylen;
+    char type[MAX_NAME];
+    /* the struct's index for struct types, -1 for builtin types */
+    int ref;
+    /* amount of elements, 0 if not an array */
+    unsigned long count;
+};
+
+struct record {
+    char name[MAX_NAME];
+    struct field fields[MAX_FIELDS];
+    int nfields;
+};
+
+static struct {
+    const char *p;
+    int line;
+    enum token tok;
+    char text[MAX_KEY];
+} lex;
+
+static struct record records[MAX_STRUCTS];
+static int nrecords;
+
+static void
+die(const char *msg)
+{
+    fprintf(stderr, "jsonb-gen: line %d: %s\n", lex.line, msg);
+    exit(EXIT_FAILURE);
+}
+
+static void
+next(void)
+{
+    size_t n = 0;
+    for (;;) {
+        while (isspace((unsigned char)*lex.p))
+            if (*lex.p++ == '\n') ++lex.line;
+        if (*lex.p != '#') break;
+        while (*lex.p && *lex.p != '\n')
+            ++lex.p;
+    }
+    if (!*lex.p) {
+        lex.tok = T_EOF;
+        lex.text[0] = '\0';
+        return;
+    }
+    if (isalpha((unsigned char)*lex.p) || *lex.p == '_') {
+        lex.tok = T_IDENT;
+        while (isalnum((unsigned char)*lex.p) || *lex.p == '_') {
+            if (n == MAX_NAME - 1) die("identifier too long");
+            lex.text[n++] = *lex.p++;
+        }
+    }
+    else if (isdigit((unsigned char)*lex.p)) {
+        lex.tok = T_NUMBER;
+        while (isdigit((unsigned char)*lex.p)) {
+            if (n == MAX_NAME - 1) die("number too long");
+            lex.text[n++] = *lex.p++;
+        }
+    }
+    else if (*lex.p == '"') {
+        /* JSON's escapes but \u, write the character itself instead */
+        static const char from[] = "\"\\/bfnrt", to[] = "\"\\/\b\f\n\r\t";
+        lex.tok = T_STRING;
+        for (++lex.p; *lex.p != '"'; ++lex.p) {
+            char c = *lex.p;
+            if (!c || c == '\n') die("unterminated key");
+            if (c == '\\') {
+                const char *esc = strchr(from, *++lex.p);
+                if (!*lex.p || !esc) die("unsupported escape in key");
+                c = to[esc - from];
+            }
+            if (n == MAX_KEY - 1) die("key too long");
+            lex.text[n++] = c;
+        }
+        ++lex.p;
+    }
+    else {
+        lex.tok = T_PUNCT;
+        lex.text[n++] = *lex.p++;
+    }
+    lex.text[n] = '\0';
+}
+
+static void
+expect(enum token tok, const char *text)
+{
+    if (lex.tok != tok || (text && strcmp(lex.text, text) != 0)) {
+        char msg[MAX_KEY + 32];
+        sprintf(msg, "expected '%s'", text ? text : "identifier");
+        die(msg);
+    }
+    next();
+}
+
+static int
+find_record(const char *name)
+{
+    int i;
+    for (i = 0; i < nrecords; ++i)
+        if (!strcmp(records[i].name, name)) return i;
+    return -1;
+}
+
+/* escape 'src' as a JSON string's contents */
+static size_t
+escape_key(char dest[], const char *src)
+{
+    size_t n = 0;
+    for (; *src; ++src) {
+        unsigned char c = *src;
+        if (n + 6 >= MAX_KEY) die("key too long");
+        if (c == '"' || c == '\\')
+            dest[n++] = '\\', dest[n++] = c;
+        else if (c < 0x20)
+            n += sprintf(dest + n, "\\u%04x", c);
+        else
+            dest[n++] = c;
+    }
+    dest[n] = '\0';
+    return n;
+}
+
+static void
+parse_field(struct record *r)
+{
+    static const char *builtins[] = { "int",  "long",   "unsigned",
+                                      "double", "bool", "string" };
+    struct field *f;
+    size_t i;
+    if (r->nfields == MAX_FIELDS) die("too many fields");
+    f = r->fields + r->nfields++;
+    f->ref = -1;
+    f->count = 0;
+    if (lex.tok == T_IDENT && !strcmp(lex.text, "struct")) {
+        next();
+        if (lex.tok != T_IDENT) die("expected struct name");
+        if ((f->ref = find_record(lex.text)) < 0) die("undeclared struct");
+    }
+    else {
+        if (lex.tok != T_IDENT) die("expected field type");
+        for (i = 0; i < sizeof(builtins) / sizeof *builtins; ++i)
+            if (!strcmp(lex.text, builtins[i])) break;
+        if (i == sizeof(builtins) / sizeof *builtins) die("unknown type");
+    }
+    strcpy(f->type, lex.text);
+    next();
+    if (lex.tok != T_IDENT) die("expected field name");
+    strcpy(f->name, lex.text);
+    next();
+    if (lex.tok == T_PUNCT && lex.text[0] == '[') {
+        next();
+        if (lex.tok != T_NUMBER) die("expected array size");
+        f->count = strtoul(lex.text, NULL, 10);
+        if (!f->count) die("empty array");
+        next();
+        expect(T_PUNCT, "]");
+    }
+    if (lex.tok == T_STRING) {
+        f->keylen = escape_key(f->key, lex.text);
+        next();
+    }
+    else
+        f->keylen = escape_key(f->key, f->name);
+    expect(T_PUNCT, ";");
+}
+
+static void
+parse(void)
+{
+    next();
+    while (lex.tok != T_EOF) {
+        struct record *r;
+        expect(T_IDENT, "struct");
+        if (lex.tok != T_IDENT) die("expected struct name");
+        if (find_record(lex.text) >= 0) die("struct redeclared");
+        if (nrecords == MAX_STRUCTS) die("too many structs");
+        r = records + nrecords;
+        strcpy(r->name, lex.text);
+        r->nfields = 0;
+        next();
+        expect(T_PUNCT, "{");
+        while (!(lex.tok == T_PUNCT && lex.text[0] == '}')) {
+            if (lex.tok == T_EOF) die("unterminated struct");
+            parse_field(r);
+        }
+        next();
+        ++nrecords;
+    }
+}
+
+/* print 's' as the contents of a C string literal */
+static void
+print_literal(const char *s)
+{
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\') putchar('\\');
+        putchar(*s);
+    }
+}
+
+/* print the statements that write the value of 'expr', and check them */
+static void
+print_value(const struct field *f, const char *expr, const char *indent)
+{
+    if (f->ref >= 0)
+        printf("%scode = %s_to_json(b, buf, bufsize, &%s);\n", indent,
+               f->type, expr);
+    else if (!strcmp(f->type, "bool"))
+        printf("%scode = jsonb_bool(b, buf, bufsize, %s);\n", indent, expr);
+    else if (!strcmp(f->type, "string"))
+        printf("%sif (!%s)\n"
+               "%s    code = jsonb_null(b, buf, bufsize);\n"
+               "%selse\n"
+               "%s    code = jsonb_string(b, buf, bufsize, %s, strlen(%s));\n",
+               indent, expr, indent, indent, indent, expr, expr);
+    else if (!strcmp(f->type, "unsigned"))
+        printf("%scode = jsonb_unsigned(b, buf, bufsize, %s);\n", indent,
+               expr);
+    else if (strcmp(f->type, "double"))
+        printf("%scode = jsonb_integer(b, buf, bufsize, %s);\n", indent,
+               expr);
+    else
+        printf("%scode = jsonb_number(b, buf, bufsize, %s);\n", indent,
+               expr);
+    printf("%sif (code < 0) return code;\n", indent);
+}
+
+/* bytes that are known at generation time, written at once by jsonb_run()
+ *      right before the next value: at most a bracket, a key and a bracket */
+static struct {
+    char text[MAX_KEY + 8];
+    size_t len;
+    char steps[8];
+    size_t nsteps;
+} run;
+
+/* a brace or bracket, which is its own step */
+static void
+run_step(char c)
+{
+    run.text[run.len++] = c;
+    run.steps[run.nsteps++] = c;
+}
+
+/* the key of a field, the comma that separates it from the previous field
+ *      is left to jsonb_run() if the key starts the run */
+static void
+run_key(const struct field *f, int first)
+{
+    if (run.nsteps && !first) run.text[run.len++] = ',';
+    run.text[run.len++] = '"';
+    memcpy(run.text + run.len, f->key, f->keylen);
+    run.len += f->keylen;
+    run.text[run.len++] = '"';
+    run.text[run.len++] = ':';
+    run.steps[run.nsteps++] = ':';
+}
+
+/* print the call that writes the run, 'last' if it ends the record */
+static void
+print_run(int last)
+{
+    run.text[run.len] = run.steps[run.nsteps] = '\0';
+    printf(last ? "    return jsonb_run(b, buf, bufsize, \""
+                : "    code = jsonb_run(b, buf, bufsize, \"");
+    print_literal(run.text);
+    printf("\", %lu, \"%s\");\n", (unsigned long)run.len, run.steps);
+    if (!last) printf("    if (code < 0) return code;\n");
+    run.len = run.nsteps = 0;
+}
+
+static void
+print_record(const struct record *r)
+{
+    int i, array = 0;
+    printf("struct %s {\n", r->name);
+    for (i = 0; i < r->nfields; ++i) {
+        const struct field *f = r->fields + i;
+        if (f->ref >= 0)
+            printf("    struct %s %s", f->type, f->name);
+        else if (!strcmp(f->type, "bool"))
+            printf("    int %s", f->name);
+        else if (!strcmp(f->type, "string"))
+            printf("    const char *%s", f->name);
+        else
+            printf("    %s %s", f->type, f->name);
+        if (f->count) {
+            printf("[%lu]", f->count);
+            array = 1;
+        }
+        printf(";\n");
+    }
+    printf("};\n\n");
+
+    printf("static jsonbcode\n"
+           "%s_to_json(jsonb *b,\n"
+           "%*s char buf[],\n"
+           "%*s size_t bufsize,\n"
+           "%*s const struct %s *v)\n"
+           "{\n"
+           "    jsonbcode code;\n",
+           r->name, (int)strlen(r->name) + 8, "", (int)strlen(r->name) + 8,
+           "", (int)strlen(r->name) + 8, "", r->name);
+    if (array) printf("    size_t i;\n");
+    /* the object's braces, the keys and the arrays' brackets are merged
+     *      into runs, the values in between are written by their emitters */
+    run_step('{');
+    for (i = 0; i < r->nfields; ++i) {
+        const struct field *f = r->fields + i;
+        char expr[MAX_NAME * 2];
+        run_key(f, i == 0);
+        if (!f->count) {
+            print_run(0);
+            sprintf(expr, "v->%s", f->name);
+            print_value(f, expr, "    ");
+            continue;
+        }
+        run_step('[');
+        print_run(0);
+        sprintf(expr, "v->%s[i]", f->name);
+        printf("    for (i = 0; i < %lu; ++i) {\n", f->count);
+        print_value(f, expr, "        ");
+        printf("    }\n");
+        run_step(']');
+    }
+    run_step('}');
+    print_run(1);
+    printf("}\n\n");
+}
+
+int
+main(void)
+{
+    static char input[MAX_INPUT + 1];
+    size_t len = fread(input, 1, MAX_INPUT, stdin);
+    int i;
+
+    if (!feof(stdin)) {
+        fprintf(stderr, "jsonb-gen: input too large\n");
+        return EXIT_FAILURE;
+    }
+    input[len] = '\0';
+    lex.p = input;
+    lex.line = 1;
+    parse();
+
+    printf("/* Generated by jsonb-gen, do not edit */\n\n"
+           "#include <string.h>\n\n"
+           "#include \"json-build.h\"\n\n");
+    for (i = 0; i < nrecords; ++i)
+        print_record(records + i);
+    return EXIT_SUCCESS;
+}
@@ -30,6 +30,23 @@ extern "C" {
 #define JSONB_MAX_DEPTH 128
 #endif /* JSONB_MAX_DEPTH */
 
+#ifndef JSONB_TRUNCATE_MARKER
+/** Appended to strings that have been truncated by @ref JSONB_TRUNCATE */
+#define JSONB_TRUNCATE_MARKER "..."
+#endif /* JSONB_TRUNCATE_MARKER */
+
+#ifdef JSONB_THREADS
+#ifndef JSONB_THREADS_MIN
+/**
+ * Length from which jsonb_string_threads() splits a string between threads,
+ *      shorter strings aren't worth the threads' startup
+ */
+#define JSONB_THREADS_MIN (1 << 20)
+#endif /* JSONB_THREADS_MIN */
+/** Maximum amount of threads of jsonb_string_threads() */
+#define JSONB_THREADS_MAX 64
+#endif /* JSONB_THREADS */
+
 /** @brief json-builder return codes */
 typedef enum jsonbcode {
     /** no error, operation was a success */
@@ -41,9 +58,35 @@ typedef enum jsonbcode {
     /** token doesn't match expected value */
     JSONB_ERROR_INPUT = -2,
     /** operation would lead to out of boundaries access */
-    JSONB_ERROR_STACK = -3
+    JSONB_ERROR_STACK = -3,
+    /** token was partially written (see @ref JSONB_NONBLOCK), flush the
+     *      buffer and call again with the same arguments */
+    JSONB_ERROR_WOULDBLOCK = -4,
+    /** token doesn't match the schema (see @ref jsonb_check) */
+    JSONB_ERROR_SCHEMA = -5
 } jsonbcode;
 
+/** @brief json-builder option flags, set after jsonb_init() */
+enum jsonbflags {
+    /** on lack of space commit as much of the token as fits, and return
+     *      @ref JSONB_ERROR_WOULDBLOCK instead of @ref JSONB_ERROR_NOMEM */
+    JSONB_NONBLOCK = 1 << 0,
+    /** don't NUL-terminate the JSON buffer, so that every one of its bytes
+     *      can be used for output (e.g. page-sized buffers fed to vmsplice) */
+    JSONB_UNTERMINATED = 1 << 1,
+    /** treat the buffer size as a hard budget: truncate strings and drop
+     *      whatever doesn't fit, while always keeping enough room to close
+     *      every open container, so that output is always valid JSON */
+    JSONB_TRUNCATE = 1 << 2,
+    /** set by the builder once @ref JSONB_TRUNCATE had to close the JSON
+     *      early, any further input is dropped */
+    JSONB_TRUNCATED = 1 << 3,
+    /** drop object members whose value is `null`, `0`, `""`, `[]` or `{}`,
+     *      the output of a member must stay in the buffer until its value
+     *      is complete (so it can be retracted) */
+    JSONB_OMITEMPTY = 1 << 4
+};
+
 /** @brief json-builder serializing state */
 enum jsonbstate {
     JSONB_INIT = 0,
@@ -57,14 +100,123 @@ enum jsonbstate {
     JSONB_DONE
 };
 
+/**
+ * @brief Node of a compiled field projection, see jsonb_fields_compile()
+ * @note node 0 is the root, so index 0 also stands for "no node"
+ */
+struct jsonb_field {
+    /** the field's key, points to the selector string */
+    const char *key;
+    /** the key length */
+    size_t len;
+    /** index of the enclosing field, of the first and next projected
+     *      subfields */
+    size_t parent, child, next;
+};
+
+/** @brief JSON value types, as a bitmask */
+enum jsonbtype {
+    JSONB_TYPE_OBJECT = 1 << 0,
+    JSONB_TYPE_ARRAY = 1 << 1,
+    JSONB_TYPE_STRING = 1 << 2,
+    JSONB_TYPE_NUMBER = 1 << 3,
+    JSONB_TYPE_BOOL = 1 << 4,
+    JSONB_TYPE_NULL = 1 << 5
+};
+
+struct jsonb_schema;
+
+/** @brief Member of an object's @ref jsonb_schema */
+struct jsonb_schema_member {
+    /** the member's key and its length */
+    const char *key;
+    size_t len;
+    /** the member's value schema, NULL if unchecked */
+    const struct jsonb_schema *schema;
+    /** whether the member is required (only for the first
+     *      @ref JSONB_SCHEMA_REQUIRED_MAX members) */
+    int required;
+};
+
+/** @brief Schema of a JSON value, checked while building (see
+ *      @ref jsonb_check) */
+struct jsonb_schema {
+    /** @ref jsonbtype bitmask of the allowed types, 0 for any type */
+    unsigned types;
+    /** members allowed for an object, NULL if any key is allowed */
+    const struct jsonb_schema_member *members;
+    size_t nmembers;
+    /** perfect hash table of the members, see jsonb_schema_compile() */
+    const size_t *table;
+    size_t tablesize;
+    unsigned long seed;
+    /** schema of an array's items, NULL if unchecked */
+    const struct jsonb_schema *items;
+    /** bounds on an array's amount of items, `max_items` 0 for unbounded */
+    size_t min_items, max_items;
+};
+
+/** @brief State of a schema check, one level per open container */
+struct jsonb_check {
+    /** schema of the top-level value */
+    const struct jsonb_schema *root;
+    /** member of the last key, NULL if unchecked */
+    const struct jsonb_schema_member *member;
+    struct {
+        /** schema of the container, NULL if unchecked */
+        const struct jsonb_schema *schema;
+        /** bitmask of the members seen, and amount of items */
+        unsigned long seen;
+        size_t count;
+        /** `seen` from before the last key, restored if @ref JSONB_OMITEMPTY
+         *      retracts its member */
+        unsigned long omit_seen;
+    } levels[JSONB_MAX_DEPTH + 1];
+};
+
 /** @brief Handle for building a JSON string */
 typedef struct jsonb {
     /** state stack to keep track and enforce next inputs */
     enum jsonbstate stack[JSONB_MAX_DEPTH + 1];
     /** pointer to stack top */
     enum jsonbstate *top;
-    /** offset in the JSON buffer (current length) */
+    /** offset in the JSON buffer (current length), or the measured length
+     *      when builder functions are given a NULL buffer */
     size_t pos;
+    /** @ref jsonbflags bitmask */
+    unsigned flags;
+    /** amount of bytes of the current token already written by a call that
+     *      returned @ref JSONB_ERROR_WOULDBLOCK */
+    size_t pending;
+    /** string offset and token offset to resume escaping from while
+     *      `pending` is set */
+    size_t resume_src, resume_pos;
+    /** room kept at the end of the buffer for closing open containers, see
+     *      @ref JSONB_TRUNCATE */
+    size_t reserve;
+    /** compiled field projection, set after jsonb_init() to skip keys that
+     *      aren't projected along with their values (NULL if unset) */
+    const struct jsonb_field *fields;
+    /** projection node of the current container, and of the last key */
+    size_t field, next_field;
+    /** set while the value of a key that isn't projected is being skipped,
+     *      the value's current depth plus one */
+    size_t skip;
+    /** bitset of the depths whose container descended a projection node */
+    unsigned char field_levels[(JSONB_MAX_DEPTH + 8) / 8];
+    /** offset of the last key (along with its comma), and whether it is its
+     *      object's first member, to retract it with @ref JSONB_OMITEMPTY
+     *      ((size_t)-1 if it can't be retracted) */
+    size_t omit_mark;
+    int omit_first;
+    /** the same for the key of each open container, or (size_t)-1 if the
+     *      container isn't an object member */
+    size_t omit_marks[JSONB_MAX_DEPTH + 1];
+    unsigned char omit_firsts[(JSONB_MAX_DEPTH + 8) / 8];
+    /** schema check, set after jsonb_init() to make builder functions
+     *      return @ref JSONB_ERROR_SCHEMA on values that violate it (NULL if
+     *      unset) */
+    struct jsonb_check *check;
 } jsonb;
 
 /**
@@ -76,6 +228,22 @@ typedef struct jsonb {
  */
 #define jsonb_reset(builder) ((builder)->pos = 0)
 
+/**
+ * @brief Buffer size that limits the next builder call to write at most `n`
+ *      bytes, for time-sliced serialization
+ * @note Should be used in conjunction with @ref JSONB_NONBLOCK, the call
+ *      returns @ref JSONB_ERROR_WOULDBLOCK if it should be continued later
+ *
+ * @param builder pointer to the @ref jsonb handle
+ * @param bufsize the JSON buffer size
+ * @param n maximum amount of bytes to be written
+ */
+#define jsonb_slice(builder, bufsize, n)                                      \
+    (jsonb_slice_end(builder, n) < (bufsize) ? jsonb_slice_end(builder, n)    \
+                                             : (bufsize))
+#define jsonb_slice_end(builder, n)                                           \
+    ((builder)->pos + (n) + !((builder)->flags & JSONB_UNTERMINATED))
+
 /**
  * @brief Initialize a jsonb handle
  *
@@ -118,6 +286,48 @@ JSONB_API jsonbcode jsonb_object_pop(jsonb *builder,
 JSONB_API jsonbcode jsonb_key(
     jsonb *builder, char buf[], size_t bufsize, const char key[], size_t len);
 
+/**
+ * @brief Push a key that is already escaped (e.g. a constant) to the builder,
+ *      it is copied as-is
+ * @note field projections and schemas match it by its unescaped form, a key
+ *      with an escape that jsonb_escape() doesn't write (other than `\/`)
+ *      matches none of their keys
+ *
+ * @param builder the builder initialized with jsonb_init()
+ * @param buf the JSON buffer
+ * @param bufsize the JSON buffer size
+ * @param key the escaped key to be inserted, without quotes
+ * @param len the key length
+ * @return @ref jsonbcode value
+ */
+JSONB_API jsonbcode jsonb_key_raw(
+    jsonb *builder, char buf[], size_t bufsize, const char key[], size_t len);
+
+/**
+ * @brief Push a run of containers, pops and escaped keys that is known
+ *      beforehand (e.g. `],"tags":[`) to the builder, with a single bounds
+ *      check for the whole run
+ * @note the run holds the commas between its steps, but not the one that
+ *      may precede its first step, which is written as needed; its keys are
+ *      copied as-is and matched as by jsonb_key_raw(), and it is written
+ *      whole or not at all, as with jsonb_table()
+ *
+ * @param builder the builder initialized with jsonb_init()
+ * @param buf the JSON buffer
+ * @param bufsize the JSON buffer size
+ * @param run the run's bytes
+ * @param len the run length
+ * @param steps the run's steps, one character each: `{` and `[` push a
+ *      container, `}` and `]` pop it, `:` is a key
+ * @return @ref jsonbcode value
+ */
+JSONB_API jsonbcode jsonb_run(jsonb *builder,
+                              char buf[],
+                              size_t bufsize,
+                              const char run[],
+                              size_t len,
+                              const char steps[]);
+
 /**
  * @brief Push an array to the builder
  *
@@ -140,6 +350,37 @@ JSONB_API jsonbcode jsonb_array_pop(jsonb *builder,
                                     char buf[],
                                     size_t bufsize);
 
+/**
+ * @brief Account for array elements that were written in place after the
+ *      builder's position (e.g. concurrently by other builders)
+ * @note every element is expected to be preceded by a comma, the comma of the
+ *      array's first element is blanked
+ *
+ * @param builder the builder initialized with jsonb_init()
+ * @param buf the JSON buffer
+ * @param bufsize the JSON buffer size
+ * @param len amount of bytes written after the builder's position
+ * @return @ref jsonbcode value
+ */
+JSONB_API jsonbcode jsonb_array_extend(jsonb *builder,
+                                       char buf[],
+                                       size_t bufsize,
+                                       size_t len);
+
+/**
+ * @brief Format numbers as array elements to be accounted for by
+ *      jsonb_array_extend(), each of them preceded by a comma
+ * @note large arrays can be split into partitions that are measured, placed
+ *      by the prefix sum of their lengths and written independently, as no
+ *      byte is written past a partition's length
+ *
+ * @param dest where to write the elements, or NULL to only measure them
+ * @param numbers the numbers to be formatted, as by jsonb_number()
+ * @param n the amount of numbers
+ * @return the length of the formatted elements
+ */
+JSONB_API size_t jsonb_numbers(char dest[], const double numbers[], size_t n);
+
 /**
  * @brief Push a raw JSON token to the builder
  *
@@ -193,6 +434,70 @@ JSONB_API jsonbcode jsonb_null(jsonb *builder, char buf[], size_t bufsize);
 JSONB_API jsonbcode jsonb_string(
     jsonb *builder, char buf[], size_t bufsize, const char str[], size_t len);
 
+/**
+ * @brief Push a string that is already escaped (e.g. by jsonb_escape()) to
+ *      the builder, it is copied as-is
+ *
+ * @param builder the builder initialized with jsonb_init()
+ * @param buf the JSON buffer
+ * @param bufsize the JSON buffer size
+ * @param str the escaped string to be inserted, without quotes
+ * @param len the string length
+ * @return @ref jsonbcode value
+ */
+JSONB_API jsonbcode jsonb_string_raw(
+    jsonb *builder, char buf[], size_t bufsize, const char str[], size_t len);
+
+/**
+ * @brief Length of a string once escaped
+ * @note escaping is done byte per byte, so a large string may be split
+ *      anywhere into chunks to be measured and escaped independently (e.g.
+ *      by several threads), each at the offset given by the sum of the
+ *      lengths of the chunks before it
+ *
+ * @param str the string to be measured
+ * @param len the string length
+ * @return the escaped length, without quotes
+ */
+JSONB_API size_t jsonb_escaped_len(const char str[], size_t len);
+
+/**
+ * @brief Escape a string (or a chunk of it) as the contents of a JSON string
+ *
+ * @param dest where to write the escaped string, at least
+ *      jsonb_escaped_len() long
+ * @param str the string to be escaped
+ * @param len the string length
+ * @return the amount of bytes written to `dest`, not NUL-terminated
+ */
+JSONB_API size_t jsonb_escape(char dest[], const char str[], size_t len);
+
+#ifdef JSONB_THREADS
+/**
+ * @brief Push a string token to the builder, a long one being measured and
+ *      escaped into place by several threads at once
+ * @note only declared if @ref JSONB_THREADS is defined (along with linking
+ *      POSIX threads); strings shorter than @ref JSONB_THREADS_MIN, and those
+ *      that need more than the builder's fast path (flags, projections,
+ *      schema checks, or lack of room), are left to jsonb_string()
+ *
+ * @param builder the builder initialized with jsonb_init()
+ * @param buf the JSON buffer
+ * @param bufsize the JSON buffer size
+ * @param str the string to be inserted
+ * @param len the string length
+ * @param nthreads amount of threads, the calling one included (at most
+ *      @ref JSONB_THREADS_MAX)
+ * @return @ref jsonbcode value
+ */
+JSONB_API jsonbcode jsonb_string_threads(jsonb *builder,
+                                         char buf[],
+                                         size_t bufsize,
+                                         const char str[],
+                                         size_t len,
+                                         int nthreads);
+#endif /* JSONB_THREADS */
+
 /**
  * @brief Push a number token to the builder
  *
@@ -207,192 +512,1576 @@ JSONB_API jsonbcode jsonb_number(jsonb *builder,
                                  size_t bufsize,
                                  double number);
 
-#ifndef JSONB_HEADER
-#include <stdio.h>
-#ifndef JSONB_DEBUG
-#define TRACE(prev, next) next
-#define DECORATOR(a)
-#else
-static const char *
-_jsonb_eval_state(enum jsonbstate state)
-{
-    switch (state) {
-    case JSONB_ARRAY_OR_OBJECT_OR_VALUE: return "array or object or value";
-    case JSONB_OBJECT_KEY_OR_CLOSE: return "object key or close";
-    case JSONB_OBJECT_NEXT_KEY_OR_CLOSE: return "object next key or close";
-    case JSONB_OBJECT_VALUE: return "object value";
-    case JSONB_ARRAY_VALUE_OR_CLOSE: return "array value or close";
-    case JSONB_ARRAY_NEXT_VALUE_OR_CLOSE: return "array next value or close";
-    case JSONB_ERROR: return "error";
-    case JSONB_DONE: return "done";
-    default: return "unknown";
-    }
-}
-#define TRACE(prev, next)                                                     \
-    do {                                                                      \
-        enum jsonbstate _prev = prev, _next = next;                           \
-        fprintf(stderr, "%s():L%d | %s -> %s\n", __func__, __LINE__,          \
-                _jsonb_eval_state(_prev), _jsonb_eval_state(_next));          \
-    } while (0)
-#define DECORATOR(d) d
-#endif /* JSONB_DEBUG */
+/**
+ * @brief Push an integer number token to the builder
+ * @note formatted exactly, without the rounding of jsonb_number() for
+ *      magnitudes beyond 2^53
+ *
+ * @param builder the builder initialized with jsonb_init()
+ * @param buf the JSON buffer
+ * @param bufsize the JSON buffer size
+ * @param number the number to be inserted
+ * @return @ref jsonbcode value
+ */
+JSONB_API jsonbcode jsonb_integer(jsonb *builder,
+                                  char buf[],
+                                  size_t bufsize,
+                                  long number);
 
-#define STACK_HEAD(b, state) *(b)->top = (state)
-#define STACK_PUSH(b, state) TRACE(*(b)->top, *++(b)->top = (state))
-#define STACK_POP(b)         TRACE(*(b)->top, DECORATOR(*)--(b)->top)
+/**
+ * @brief Push an unsigned integer number token to the builder, as by
+ *      jsonb_integer()
+ *
+ * @param builder the builder initialized with jsonb_init()
+ * @param buf the JSON buffer
+ * @param bufsize the JSON buffer size
+ * @param number the number to be inserted
+ * @return @ref jsonbcode value
+ */
+JSONB_API jsonbcode jsonb_unsigned(jsonb *builder,
+                                   char buf[],
+                                   size_t bufsize,
+                                   unsigned long number);
 
-#define BUFFER_COPY_CHAR(b, c, _pos, buf, bufsize)                            \
-    do {                                                                      \
-        if ((b)->pos + (_pos) + 1 + 1 > (bufsize)) {                          \
-            (buf)[(b)->pos] = '\0';                                           \
-            return JSONB_ERROR_NOMEM;                                         \
-        }                                                                     \
-        (buf)[(b)->pos + (_pos)++] = (c);                                     \
-        (buf)[(b)->pos + (_pos)] = '\0';                                      \
-    } while (0)
-#define BUFFER_COPY(b, value, len, _pos, buf, bufsize)                        \
-    do {                                                                      \
-        size_t i;                                                             \
-        if ((b)->pos + (_pos) + (len) + 1 > (bufsize)) {                      \
-            (buf)[(b)->pos] = '\0';                                           \
-            return JSONB_ERROR_NOMEM;                                         \
-        }                                                                     \
-        for (i = 0; i < (len); ++i)                                           \
-            (buf)[(b)->pos + (_pos) + i] = (value)[i];                        \
-        (_pos) += (len);                                                      \
-        (buf)[(b)->pos + (_pos)] = '\0';                                      \
-    } while (0)
+/**
+ * @brief Close every open container, so that the JSON is complete
+ * @note a key that is missing its value gets a `null`
+ *
+ * @param builder the builder initialized with jsonb_init()
+ * @param buf the JSON buffer
+ * @param bufsize the JSON buffer size
+ * @return @ref jsonbcode value
+ */
+JSONB_API jsonbcode jsonb_close_all(jsonb *builder,
+                                    char buf[],
+                                    size_t bufsize);
 
-JSONB_API void
-jsonb_init(jsonb *b)
-{
-    static jsonb empty_builder;
-    *b = empty_builder;
-    b->top = b->stack;
-}
+/** @brief Column of a table stored column-wise, see jsonb_table() */
+struct jsonb_column {
+    /** the column's key, already escaped */
+    const char *key;
+    size_t keylen;
+    /** @ref JSONB_TYPE_NUMBER for `const double *` data,
+     *      @ref JSONB_TYPE_BOOL for `const int *` and @ref JSONB_TYPE_STRING
+     *      for `const char *const *` (NUL-terminated, NULL for null) */
+    enum jsonbtype type;
+    /** the column's values, one per row */
+    const void *data;
+};
 
-JSONB_API jsonbcode
-jsonb_object(jsonb *b, char buf[], size_t bufsize)
-{
-    enum jsonbstate new_state;
-    size_t pos = 0;
-    if (b->top - b->stack >= JSONB_MAX_DEPTH) return JSONB_ERROR_STACK;
-    switch (*b->top) {
-    case JSONB_ARRAY_NEXT_VALUE_OR_CLOSE:
-        BUFFER_COPY_CHAR(b, ',', pos, buf, bufsize);
-        /* fall-through */
-    case JSONB_ARRAY_VALUE_OR_CLOSE:
-        new_state = JSONB_ARRAY_NEXT_VALUE_OR_CLOSE;
-        break;
-    case JSONB_OBJECT_VALUE:
-        new_state = JSONB_OBJECT_NEXT_KEY_OR_CLOSE;
-        break;
-    case JSONB_ARRAY_OR_OBJECT_OR_VALUE:
-        new_state = JSONB_DONE;
-        break;
-    default:
-        STACK_HEAD(b, JSONB_ERROR);
-        /* fall-through */
-    case JSONB_DONE:
-    case JSONB_ERROR:
-        return JSONB_ERROR_INPUT;
-    }
-    BUFFER_COPY_CHAR(b, '{', pos, buf, bufsize);
-    STACK_HEAD(b, new_state);
-    STACK_PUSH(b, JSONB_OBJECT_KEY_OR_CLOSE);
-    b->pos += pos;
-    return JSONB_OK;
-}
+/**
+ * @brief Push a table stored column-wise as an array of objects, with a
+ *      member per column
+ * @note the table is written whole or not at all, so that it can be retried
+ *      after @ref JSONB_ERROR_NOMEM (unless @ref JSONB_TRUNCATE is set), and
+ *      nothing is written if a row fails the schema check
+ *
+ * @param builder the builder initialized with jsonb_init()
+ * @param buf the JSON buffer
+ * @param bufsize the JSON buffer size
+ * @param columns the table's columns
+ * @param ncols the amount of columns
+ * @param nrows the amount of rows
+ * @return @ref jsonbcode value, @ref JSONB_ERROR_INPUT if a column's type
+ *      isn't supported
+ */
+JSONB_API jsonbcode jsonb_table(jsonb *builder,
+                                char buf[],
+                                size_t bufsize,
+                                const struct jsonb_column columns[],
+                                size_t ncols,
+                                size_t nrows);
 
-JSONB_API jsonbcode
-jsonb_object_pop(jsonb *b, char buf[], size_t bufsize)
-{
-    enum jsonbcode code;
-    size_t pos = 0;
-    switch (*b->top) {
-    case JSONB_OBJECT_KEY_OR_CLOSE:
-    case JSONB_OBJECT_NEXT_KEY_OR_CLOSE:
-        code = b->stack == b->top - 1 ? JSONB_END : JSONB_OK;
-        break;
-    default:
-        STACK_HEAD(b, JSONB_ERROR);
-        /* fall-through */
-    case JSONB_DONE:
-    case JSONB_ERROR:
-        return JSONB_ERROR_INPUT;
-    }
-    BUFFER_COPY_CHAR(b, '}', pos, buf, bufsize);
-    STACK_POP(b);
-    b->pos += pos;
-    return code;
-}
+/**
+ * @brief Push an object from parallel arrays of keys and string values (e.g.
+ *      labels, environment variables or HTTP headers)
+ * @note the object is written whole or not at all, as with jsonb_table()
+ *
+ * @param builder the builder initialized with jsonb_init()
+ * @param buf the JSON buffer
+ * @param bufsize the JSON buffer size
+ * @param keys the keys
+ * @param klens the keys lengths
+ * @param vals the values, NULL for null
+ * @param vlens the values lengths
+ * @param n the amount of pairs
+ * @return @ref jsonbcode value
+ */
+JSONB_API jsonbcode jsonb_object_from_pairs(jsonb *builder,
+                                            char buf[],
+                                            size_t bufsize,
+                                            const char *const keys[],
+                                            const size_t klens[],
+                                            const char *const vals[],
+                                            const size_t vlens[],
+                                            size_t n);
 
-static long
-_jsonb_escape(
-    size_t *pos, char buf[], size_t bufsize, const char str[], size_t len)
-{
-    char *esc_tok = NULL, _esc_tok[8] = "\\u00";
-    char *esc_buf = NULL;
-    int extra_bytes = 0;
-    size_t i;
-second_iter:
-    /* 1st iteration, esc_buf is NULL and count extra_bytes needed for escaping
-     * 2st iteration, esc_buf is not NULL, and does escaping.  */
-    for (i = 0; i < len; ++i) {
-        unsigned char c = str[i];
-        esc_tok = NULL;
-        switch (c) {
-        case 0x22: esc_tok = "\\\""; break;
-        case 0x5C: esc_tok = "\\\\"; break;
-        case '\b': esc_tok = "\\b"; break;
-        case '\f': esc_tok = "\\f"; break;
-        case '\n': esc_tok = "\\n"; break;
-        case '\r': esc_tok = "\\r"; break;
-        case '\t': esc_tok = "\\t"; break;
-        default: if (c <= 0x1F) {
-                   static const char tohex[] = "0123456789abcdef";
-                   _esc_tok[4] = tohex[c >> 4];
-                   _esc_tok[5] = tohex[c & 0xF];
-                   _esc_tok[6] = 0;
-                   esc_tok = _esc_tok;
-                 }
-        }
-        if (esc_tok) {
-            int j;
-            for (j = 0; esc_tok[j]; j++) {
-                if (!esc_buf) /* count how many extra bytes are needed */
-                    continue;
-                *esc_buf++ = esc_tok[j];
-            }
-            extra_bytes += j - 1;
-        }
-        else if (esc_buf) {
-            *esc_buf++ = c;
-        }
-    }
+/**
+ * @brief Push an object from parallel arrays of keys and number values
+ * @see jsonb_object_from_pairs()
+ *
+ * @param builder the builder initialized with jsonb_init()
+ * @param buf the JSON buffer
+ * @param bufsize the JSON buffer size
+ * @param keys the keys
+ * @param klens the keys lengths
+ * @param numbers the values
+ * @param n the amount of pairs
+ * @return @ref jsonbcode value
+ */
+JSONB_API jsonbcode jsonb_object_from_numbers(jsonb *builder,
+                                              char buf[],
+                                              size_t bufsize,
+                                              const char *const keys[],
+                                              const size_t klens[],
+                                              const double numbers[],
+                                              size_t n);
 
-    if (*pos + len + extra_bytes > bufsize) return JSONB_ERROR_NOMEM;
+/**
+ * @brief Compile a field selector into a projection for @ref jsonb.fields
+ *
+ * The selector is a comma separated list of keys, where `a/b` selects the
+ * `b` member of `a`, and `a(b,c)` the `b` and `c` members of `a`: e.g.
+ * `id,owner(name,email),meta/created`. A key without subfields selects its
+ * whole value, and keys of arrays apply to each of their objects.
+ * @note the nodes point to `selector`, which must outlive the projection
+ *
+ * @param fields the array of nodes to be filled
+ * @param nfields amount of nodes in the array
+ * @param selector the field selector
+ * @param len the selector length
+ * @return amount of nodes used, or @ref JSONB_ERROR_NOMEM if `nfields` is
+ *      not enough, @ref JSONB_ERROR_INPUT if the selector is malformed and
+ *      @ref JSONB_ERROR_STACK if it exceeds @ref JSONB_MAX_DEPTH
+ */
+JSONB_API long jsonb_fields_compile(struct jsonb_field fields[],
+                                    size_t nfields,
+                                    const char selector[],
+                                    size_t len);
 
-    if (esc_buf) {
-        *pos += len + extra_bytes;
-        return JSONB_OK;
-    }
-    if (!extra_bytes) {
-        size_t j;
-        for (j = 0; j < len; ++j)
-            buf[*pos + j] = str[j];
-        *pos += len;
-        return JSONB_OK;
-    }
-    esc_buf = buf + *pos;
-    extra_bytes = 0;
-    goto second_iter;
-}
+/**
+ * @brief Check whether a key of the current object is projected, so that
+ *      expensive values can be left uncomputed
+ *
+ * @param builder the builder initialized with jsonb_init()
+ * @param key the key to be checked
+ * @param len the key length
+ * @return 1 if jsonb_key() would write the key, 0 if it would be skipped
+ */
+JSONB_API int jsonb_wanted(const jsonb *builder, const char key[], size_t len);
 
-JSONB_API jsonbcode
-jsonb_key(jsonb *b, char buf[], size_t bufsize, const char key[], size_t len)
-{
+/** members past this index can't be required */
+#define JSONB_SCHEMA_REQUIRED_MAX 32
+/** amount of seeds tried by jsonb_schema_compile() */
+#define JSONB_SCHEMA_SEEDS 65536
+
+/**
+ * @brief Find a perfect hash for an object schema's members, so that keys
+ *      are checked with a single lookup
+ * @note schemas that aren't compiled have their members searched linearly
+ *
+ * @param schema the object schema
+ * @param table the hash table to be filled, owned by the caller
+ * @param tablesize amount of entries in the table (at least `nmembers`, a
+ *      larger table makes a perfect hash quicker to find)
+ * @return @ref JSONB_OK, @ref JSONB_ERROR_NOMEM if no perfect hash has been
+ *      found for `tablesize`, or @ref JSONB_ERROR_INPUT if a key is
+ *      duplicated or a member past @ref JSONB_SCHEMA_REQUIRED_MAX is required
+ */
+JSONB_API jsonbcode jsonb_schema_compile(struct jsonb_schema *schema,
+                                         size_t table[],
+                                         size_t tablesize);
+
+/**
+ * @brief Initialize a schema check, to be set as @ref jsonb.check
+ *
+ * @param check the check to be initialized
+ * @param root schema of the top-level value
+ */
+JSONB_API void jsonb_check_init(struct jsonb_check *check,
+                                const struct jsonb_schema *root);
+
+/** @brief Slot of a @ref jsonb_memo cache */
+struct jsonb_memo_slot {
+    /** the caller-supplied hash of the subdocument */
+    unsigned long hash;
+    /** the rendered subdocument length, 0 if the slot is free */
+    size_t len;
+    /** the cache clock at the slot's last use */
+    unsigned long used;
+};
+
+/** @brief Cache of rendered subdocuments, with LRU eviction */
+typedef struct jsonb_memo {
+    /** caller-provided slots, each owning `slot_size` bytes of `arena` */
+    struct jsonb_memo_slot *slots;
+    size_t nslots;
+    char *arena;
+    size_t slot_size;
+    /** incremented on every use of a slot */
+    unsigned long clock;
+    /** amount of lookups that found or missed the subdocument, and of
+     *      subdocuments evicted to make room for others */
+    unsigned long hits, misses, evictions;
+} jsonb_memo;
+
+/**
+ * @brief Initialize a memo cache, whose arena is split evenly among its slots
+ *
+ * @param memo the cache to be initialized
+ * @param slots the cache slots
+ * @param nslots amount of slots (must be at least 1)
+ * @param arena storage for the rendered subdocuments
+ * @param arenasize the arena size
+ */
+JSONB_API void jsonb_memo_init(jsonb_memo *memo,
+                               struct jsonb_memo_slot slots[],
+                               size_t nslots,
+                               char arena[],
+                               size_t arenasize);
+
+/**
+ * @brief Look up a rendered subdocument, to be spliced with jsonb_token()
+ *
+ * @param memo the cache initialized with jsonb_memo_init()
+ * @param hash the subdocument's hash
+ * @param value set to the rendered subdocument on a hit
+ * @param len set to the rendered subdocument length on a hit
+ * @return 1 on a hit, 0 on a miss
+ */
+JSONB_API int jsonb_memo_lookup(jsonb_memo *memo,
+                                unsigned long hash,
+                                const char **value,
+                                size_t *len);
+
+/**
+ * @brief Store a rendered subdocument, evicting the least recently used one
+ *      if there is no free slot left
+ *
+ * @param memo the cache initialized with jsonb_memo_init()
+ * @param hash the subdocument's hash
+ * @param value the rendered subdocument
+ * @param len the rendered subdocument length
+ * @return 1 if stored, 0 if `len` is 0 or larger than a slot
+ */
+JSONB_API int jsonb_memo_store(jsonb_memo *memo,
+                               unsigned long hash,
+                               const char value[],
+                               size_t len);
+
+/** @brief Slot of a @ref jsonb_keycache */
+struct jsonb_keycache_slot {
+    unsigned long hash;
+    /** the key length, 0 if the slot is free */
+    size_t keylen;
+    /** the escaped key length, 0 if the key needs no escaping */
+    size_t len;
+    /** incremented whenever the slot is given to another key */
+    unsigned long gen;
+};
+
+/**
+ * @brief Direct-mapped cache of escaped keys, for keys that are runtime data
+ *      but heavily repeated (e.g. label or metric names)
+ */
+typedef struct jsonb_keycache {
+    /** caller-provided slots, each owning `slot_size` bytes of `arena` for
+     *      the key followed by its escaped form */
+    struct jsonb_keycache_slot *slots;
+    size_t nslots;
+    char *arena;
+    size_t slot_size;
+    /** amount of lookups that found the key, or missed it (including keys
+     *      that don't fit a slot), a @ref jsonb_keyref is only looked up
+     *      again once its slot has been given to another key */
+    unsigned long hits, misses;
+    /** amount of arena bytes used by the cached keys */
+    size_t bytes;
+} jsonb_keycache;
+
+/**
+ * @brief Initialize a key cache, whose arena is split evenly among its slots
+ *
+ * @param cache the cache to be initialized
+ * @param slots the cache slots
+ * @param nslots amount of slots (must be at least 1)
+ * @param arena storage for the cached keys
+ * @param arenasize the arena size
+ */
+JSONB_API void jsonb_keycache_init(jsonb_keycache *cache,
+                                   struct jsonb_keycache_slot slots[],
+                                   size_t nslots,
+                                   char arena[],
+                                   size_t arenasize);
+
+/** @brief Key looked up in a @ref jsonb_keycache, kept by the caller */
+struct jsonb_keyref {
+    /** the key, which must outlive the reference */
+    const char *key;
+    size_t len;
+    /** the key's slot, or (size_t)-1 if it doesn't fit one */
+    size_t slot;
+    /** the slot's `gen` when the key was looked up */
+    unsigned long gen;
+};
+
+/**
+ * @brief Look up a key in the cache, storing it on a miss, and make a
+ *      reference to it to be pushed with jsonb_key_ref()
+ *
+ * @param cache the cache initialized with jsonb_keycache_init()
+ * @param ref the reference to be set
+ * @param key the key, which must outlive the reference
+ * @param len the key length
+ */
+JSONB_API void jsonb_keycache_ref(jsonb_keycache *cache,
+                                  struct jsonb_keyref *ref,
+                                  const char key[],
+                                  size_t len);
+
+/**
+ * @brief Push a key referenced by jsonb_keycache_ref() to the builder as
+ *      jsonb_key() does, its escaped form is copied as-is from the cache
+ *      (the key is looked up again if its slot has been given to another
+ *      key since)
+ *
+ * @param builder the builder initialized with jsonb_init()
+ * @param buf the JSON buffer
+ * @param bufsize the JSON buffer size
+ * @param cache the cache the key has been looked up in
+ * @param ref the key's reference
+ * @return @ref jsonbcode value
+ */
+JSONB_API jsonbcode jsonb_key_ref(jsonb *builder,
+                                  char buf[],
+                                  size_t bufsize,
+                                  jsonb_keycache *cache,
+                                  struct jsonb_keyref *ref);
+
+/** @brief Subdocument rendered apart, see jsonb_stitch_complete() */
+struct jsonb_child {
+    /** the member's key if the parent is an object, NULL otherwise */
+    const char *key;
+    size_t keylen;
+    /** the rendered subdocument, set once completed */
+    const char *json;
+    size_t len;
+    int done;
+};
+
+/**
+ * @brief Children of a container, rendered apart (e.g. by a thread pool, in
+ *      any order) and stitched into the parent builder in document order
+ */
+typedef struct jsonb_stitch {
+    /** caller-provided children, in document order */
+    struct jsonb_child *children;
+    size_t nchildren;
+    /** the first child that hasn't been stitched yet */
+    size_t next;
+} jsonb_stitch;
+
+/**
+ * @brief Initialize the stitching of children
+ *
+ * @param stitch the stitch to be initialized
+ * @param children the children, in document order, with their keys set
+ * @param nchildren the amount of children
+ */
+JSONB_API void jsonb_stitch_init(jsonb_stitch *stitch,
+                                 struct jsonb_child children[],
+                                 size_t nchildren);
+
+/**
+ * @brief Mark a child as completed
+ * @note calls to jsonb_stitch_complete() and jsonb_stitch_flush() must be
+ *      serialized by the caller (e.g. under the pool's lock)
+ *
+ * @param stitch the stitch initialized with jsonb_stitch_init()
+ * @param i the child's index
+ * @param json the rendered subdocument, kept alive until it is stitched
+ * @param len the subdocument length
+ */
+JSONB_API void jsonb_stitch_complete(jsonb_stitch *stitch,
+                                     size_t i,
+                                     const char json[],
+                                     size_t len);
+
+/**
+ * @brief Splice every completed child that follows the ones stitched so far
+ *      into the parent builder, up to the first child that isn't completed
+ *
+ * @param builder the parent builder, inside the children's container
+ * @param buf the JSON buffer
+ * @param bufsize the JSON buffer size
+ * @param stitch the stitch initialized with jsonb_stitch_init()
+ * @return @ref jsonbcode value of the last child stitched, a failed child is
+ *      stitched again by the next call
+ */
+JSONB_API jsonbcode jsonb_stitch_flush(jsonb *builder,
+                                       char buf[],
+                                       size_t bufsize,
+                                       jsonb_stitch *stitch);
+
+/**
+ * @brief Builder operations, as recorded by jsonb_tape_record() and executed
+ *      by jsonb_exec()
+ */
+enum jsonbop {
+    JSONB_OP_OBJECT = 0,
+    JSONB_OP_OBJECT_POP,
+    JSONB_OP_KEY,
+    JSONB_OP_ARRAY,
+    JSONB_OP_ARRAY_POP,
+    JSONB_OP_TOKEN,
+    JSONB_OP_BOOL,
+    JSONB_OP_NULL,
+    JSONB_OP_STRING,
+    JSONB_OP_NUMBER
+};
+
+/** @brief Tape of recorded builder operations, see jsonb_tape_record() */
+typedef struct jsonb_tape {
+    /** caller-provided storage for the tape */
+    char *buf;
+    size_t size;
+    /** amount of bytes recorded */
+    size_t pos;
+} jsonb_tape;
+
+/**
+ * @brief Initialize an empty tape
+ *
+ * @param tape the tape to be initialized
+ * @param buf storage for the tape
+ * @param size the storage size
+ */
+JSONB_API void jsonb_tape_init(jsonb_tape *tape, char buf[], size_t size);
+
+/**
+ * @brief Record a builder operation to be replayed later, so that the cost
+ *      of formatting is moved off the caller's critical path
+ * @note strings are copied into the tape, in the host's native format
+ *
+ * @param tape the tape initialized with jsonb_tape_init()
+ * @param op the builder operation
+ * @param str the key, token or string of @ref JSONB_OP_KEY,
+ *      @ref JSONB_OP_TOKEN and @ref JSONB_OP_STRING
+ * @param len the `str` length
+ * @param number the number of @ref JSONB_OP_NUMBER, or the boolean of
+ *      @ref JSONB_OP_BOOL
+ * @return @ref JSONB_OK, @ref JSONB_ERROR_NOMEM if the tape is full, or
+ *      @ref JSONB_ERROR_INPUT if `op` is unknown
+ */
+JSONB_API jsonbcode jsonb_tape_record(jsonb_tape *tape,
+                                      enum jsonbop op,
+                                      const char str[],
+                                      size_t len,
+                                      double number);
+
+/**
+ * @brief Replay recorded operations through the builder, up to the end of
+ *      the tape or of the current JSON
+ *
+ * @param builder the builder initialized with jsonb_init()
+ * @param buf the JSON buffer
+ * @param bufsize the JSON buffer size
+ * @param tape the recorded tape
+ * @param offset tape offset to replay from, advanced past every operation
+ *      that succeeded
+ * @return @ref jsonbcode value of the last operation, @ref JSONB_END once a
+ *      JSON is complete (the next one is replayed by calling again with a
+ *      new builder), or @ref JSONB_ERROR_INPUT if the tape is malformed
+ */
+JSONB_API jsonbcode jsonb_tape_replay(jsonb *builder,
+                                      char buf[],
+                                      size_t bufsize,
+                                      const jsonb_tape *tape,
+                                      size_t *offset);
+
+/** @brief Builder operation executed by jsonb_exec() */
+struct jsonb_op {
+    enum jsonbop op;
+    /** the key, token or string of @ref JSONB_OP_KEY, @ref JSONB_OP_TOKEN
+     *      and @ref JSONB_OP_STRING */
+    const char *str;
+    size_t len;
+    /** the number of @ref JSONB_OP_NUMBER, or the boolean of
+     *      @ref JSONB_OP_BOOL */
+    double number;
+};
+
+/**
+ * @brief Execute a batch of builder operations, so that bindings cross into
+ *      the library once per batch rather than once per value
+ *
+ * @param builder the builder initialized with jsonb_init()
+ * @param buf the JSON buffer
+ * @param bufsize the JSON buffer size
+ * @param ops the operations, in document order
+ * @param n the amount of operations
+ * @param code if not NULL, receives the @ref jsonbcode value of the last
+ *      operation executed
+ * @return the index of the first operation that failed, or `n` if all of
+ *      them succeeded; after @ref JSONB_ERROR_NOMEM the batch can be resumed
+ *      from that index with a larger buffer
+ */
+JSONB_API size_t jsonb_exec(jsonb *builder,
+                            char buf[],
+                            size_t bufsize,
+                            const struct jsonb_op ops[],
+                            size_t n,
+                            jsonbcode *code);
+
+/** @brief Levels of the records written by a @ref jsonb_logger */
+enum jsonblevel {
+    JSONB_LOG_DEBUG = 0,
+    JSONB_LOG_INFO,
+    JSONB_LOG_WARN,
+    JSONB_LOG_ERROR
+};
+
+/** @brief Structured logger that writes NDJSON records, see JSONB_LOG() */
+typedef struct jsonb_logger {
+    /** builder of the current record, records that don't fit the buffer are
+     *      cut short by @ref JSONB_TRUNCATE */
+    jsonb b;
+    /** caller-provided buffer for a single record */
+    char *buf;
+    size_t bufsize;
+    /** records below this level are filtered out */
+    enum jsonblevel level;
+    /** only one out of every `sample` records that pass the level filter is
+     *      written (every record if 0 or 1) */
+    unsigned long sample;
+    /** amount of records that passed the level filter, sampled out or not */
+    unsigned long count;
+    /** level of the current record, so that JSONB_LOG() evaluates it once */
+    enum jsonblevel record_level;
+    /** set while a record is being written */
+    int active;
+    /** called with each complete record, along with its newline */
+    void (*sink)(void *data, const char line[], size_t len);
+    void *data;
+} jsonb_logger;
+
+/**
+ * @brief Write a log record with the statement (or block) that follows,
+ *      which isn't evaluated at all if the record is filtered out
+ * @note `logger` is evaluated several times, and the statement must not
+ *      `break` or `return` out of the record
+ *
+ * @code
+ * JSONB_LOG(&logger, JSONB_LOG_INFO) {
+ *     jsonb_log_string(&logger, JSONB_LOG_KEY("msg"), "connected", 9);
+ *     jsonb_log_number(&logger, JSONB_LOG_KEY("fd"), fd);
+ * }
+ * @endcode
+ *
+ * @param logger the logger initialized with jsonb_logger_init()
+ * @param lvl the record's @ref jsonblevel
+ */
+#define JSONB_LOG(logger, lvl)                                                \
+    for ((logger)->active =                                                   \
+             ((logger)->record_level = (lvl)) >= (logger)->level              \
+             && jsonb_log_begin(logger, (logger)->record_level);              \
+         (logger)->active; jsonb_log_end(logger))
+
+/** @brief A constant key along with its length, see JSONB_LOG() */
+#define JSONB_LOG_KEY(key) key, sizeof(key) - 1
+
+/**
+ * @brief Initialize a structured logger, which writes every record
+ *
+ * @param logger the logger to be initialized
+ * @param buf the record buffer
+ * @param bufsize the record buffer size
+ * @param sink called with each record
+ * @param data user data passed to `sink`
+ */
+JSONB_API void jsonb_logger_init(
+    jsonb_logger *logger,
+    char buf[],
+    size_t bufsize,
+    void (*sink)(void *data, const char line[], size_t len),
+    void *data);
+
+/**
+ * @brief Start a record, unless it is sampled out
+ * @note meant to be called by JSONB_LOG(), after the level filter
+ *
+ * @param logger the logger initialized with jsonb_logger_init()
+ * @param level the record's @ref jsonblevel
+ * @return 1 if the record has been started, 0 if it is sampled out
+ */
+JSONB_API int jsonb_log_begin(jsonb_logger *logger, enum jsonblevel level);
+
+/**
+ * @brief Add a string field to the current record
+ *
+ * @param logger the logger initialized with jsonb_logger_init()
+ * @param key the field's key, escaped beforehand (see JSONB_LOG_KEY())
+ * @param klen the key length
+ * @param str the string to be inserted
+ * @param len the string length
+ */
+JSONB_API void jsonb_log_string(jsonb_logger *logger,
+                                const char key[],
+                                size_t klen,
+                                const char str[],
+                                size_t len);
+
+/**
+ * @brief Add a number field to the current record
+ *
+ * @param logger the logger initialized with jsonb_logger_init()
+ * @param key the field's key, escaped beforehand (see JSONB_LOG_KEY())
+ * @param klen the key length
+ * @param number the number to be inserted
+ */
+JSONB_API void jsonb_log_number(jsonb_logger *logger,
+                                const char key[],
+                                size_t klen,
+                                double number);
+
+/**
+ * @brief Add a boolean field to the current record
+ *
+ * @param logger the logger initialized with jsonb_logger_init()
+ * @param key the field's key, escaped beforehand (see JSONB_LOG_KEY())
+ * @param klen the key length
+ * @param boolean the boolean to be inserted
+ */
+JSONB_API void jsonb_log_bool(jsonb_logger *logger,
+                              const char key[],
+                              size_t klen,
+                              int boolean);
+
+/**
+ * @brief Complete the current record and hand it to the sink
+ * @note meant to be called by JSONB_LOG()
+ *
+ * @param logger the logger initialized with jsonb_logger_init()
+ */
+JSONB_API void jsonb_log_end(jsonb_logger *logger);
+
+/** version of the format written by jsonb_save(), bumped whenever the
+ *      builder state it carries changes */
+#define JSONB_SAVE_VERSION 2
+/** jsonb_save() header size: version, flags, depth, then pos, pending, the
+ *      resume offsets, reserve, projection nodes, skip and omit mark, and
+ *      whether the omit mark is its object's first member */
+#define JSONB_SAVE_HEADER (1 + 4 + 4 + 9 * 8 + 1)
+/** jsonb_save() size of a state at depth `depth`: a byte per level (its
+ *      state and bits) and the omit mark of each open container */
+#define JSONB_SAVE_SIZE(depth) (JSONB_SAVE_HEADER + (depth) + 1 + 8 * (depth))
+/** buffer size that fits any state written by jsonb_save() */
+#define JSONB_SAVE_MAX JSONB_SAVE_SIZE(JSONB_MAX_DEPTH)
+
+/**
+ * @brief Serialize the builder's state into a compact, portable format, so it
+ *      can be persisted (e.g. as a checkpoint of a long running export)
+ * @note pointers set to the builder aren't saved and should be set again
+ *      after jsonb_load(): a field projection must be the same one, it then
+ *      resumes where it was. A schema check's state isn't saved, so a
+ *      builder can't be saved while `check` is set
+ *
+ * @param builder the builder initialized with jsonb_init()
+ * @param buf the state buffer
+ * @param bufsize the state buffer size (@ref JSONB_SAVE_MAX is always enough)
+ * @return amount of bytes written, or 0 if `bufsize` is not large enough or
+ *      `check` is set
+ */
+JSONB_API size_t jsonb_save(const jsonb *builder, char buf[], size_t bufsize);
+
+/**
+ * @brief Restore a builder's state that has been serialized by jsonb_save()
+ *
+ * @param builder the builder to be restored
+ * @param buf the state buffer
+ * @param bufsize the state buffer size
+ * @return @ref JSONB_OK, or @ref JSONB_ERROR_INPUT if the state is malformed
+ *      or of a different version, or @ref JSONB_ERROR_STACK if its depth
+ *      exceeds @ref JSONB_MAX_DEPTH
+ */
+JSONB_API jsonbcode jsonb_load(jsonb *builder,
+                               const char buf[],
+                               size_t bufsize);
+
+#ifndef JSONB_HEADER
+#include <stdio.h>
+#include <string.h>
+#ifdef JSONB_THREADS
+#include <pthread.h>
+#endif /* JSONB_THREADS */
+#ifndef JSONB_DEBUG
+#define TRACE(prev, next) next
+#define DECORATOR(a)
+#else
+static const char *
+_jsonb_eval_state(enum jsonbstate state)
+{
+    switch (state) {
+    case JSONB_ARRAY_OR_OBJECT_OR_VALUE: return "array or object or value";
+    case JSONB_OBJECT_KEY_OR_CLOSE: return "object key or close";
+    case JSONB_OBJECT_NEXT_KEY_OR_CLOSE: return "object next key or close";
+    case JSONB_OBJECT_VALUE: return "object value";
+    case JSONB_ARRAY_VALUE_OR_CLOSE: return "array value or close";
+    case JSONB_ARRAY_NEXT_VALUE_OR_CLOSE: return "array next value or close";
+    case JSONB_ERROR: return "error";
+    case JSONB_DONE: return "done";
+    default: return "unknown";
+    }
+}
+#define TRACE(prev, next)                                                     \
+    do {                                                                      \
+        enum jsonbstate _prev = prev, _next = next;                           \
+        fprintf(stderr, "%s():L%d | %s -> %s\n", __func__, __LINE__,          \
+                _jsonb_eval_state(_prev), _jsonb_eval_state(_next));          \
+    } while (0)
+#define DECORATOR(d) d
+#endif /* JSONB_DEBUG */
+
+#define STACK_HEAD(b, state) *(b)->top = (state)
+#define STACK_PUSH(b, state) TRACE(*(b)->top, *++(b)->top = (state))
+#define STACK_POP(b)         TRACE(*(b)->top, DECORATOR(*)--(b)->top)
+
+/* never touch memory past 'bufsize', the buffer may be a fixed-size region
+ *      (e.g. a shared-memory slot) that is followed by someone else's data */
+#define BUFFER_TERMINATE(b, buf, bufsize)                                     \
+    do {                                                                      \
+        if ((buf) && (b)->pos < (bufsize)                                     \
+            && !((b)->flags & JSONB_UNTERMINATED))                            \
+            (buf)[(b)->pos] = '\0';                                           \
+    } while (0)
+/* room kept at the end of the buffer for the NUL terminator and closers */
+#define BUFFER_TAIL(b)                                                        \
+    ((((b)->flags & JSONB_UNTERMINATED) ? 0 : 1) + (b)->reserve)
+/* closers needed once the token is written, 'extra' is the token's effect
+ *      on the depth (or the room for 'null' to follow a key) */
+#define BUFFER_RESERVE(b, extra)                                              \
+    ((b)->reserve = ((b)->flags & JSONB_TRUNCATE)                             \
+                        ? (size_t)((b)->top - (b)->stack + (extra))           \
+                        : 0)
+/* input that comes after the JSON has been truncated is silently dropped */
+#define DONE_CODE(b)                                                          \
+    ((*(b)->top == JSONB_DONE && ((b)->flags & JSONB_TRUNCATED))              \
+         ? JSONB_END                                                          \
+         : JSONB_ERROR_INPUT)
+/* offset in 'buf' of the token's '_pos'-th byte, bytes before 'pending' were
+ *      committed by a previous call that returned JSONB_ERROR_WOULDBLOCK */
+#define BUFFER_OFFSET(b, _pos) ((b)->pos + ((_pos) - (b)->pending))
+#define BUFFER_COPY_CHAR(b, c, _pos, buf, bufsize)                            \
+    do {                                                                      \
+        /* a NULL 'buf' only measures the output length */                   \
+        if ((buf) && (_pos) >= (b)->pending) {                                \
+            if (BUFFER_OFFSET(b, _pos) + 1 + BUFFER_TAIL(b) > (bufsize))      \
+                return _jsonb_nomem(b, buf, bufsize, _pos);                   \
+            (buf)[BUFFER_OFFSET(b, _pos)] = (c);                              \
+        }                                                                     \
+        ++(_pos);                                                             \
+    } while (0)
+#define BUFFER_COPY(b, value, len, _pos, buf, bufsize)                        \
+    do {                                                                      \
+        size_t i = 0;                                                         \
+        if ((b)->pending > (_pos)) { /* skip what's already been written */  \
+            i = (b)->pending - (_pos) < (len) ? (b)->pending - (_pos) : (len); \
+            (_pos) += i;                                                      \
+        }                                                                     \
+        for (; i < (len); ++i)                                                \
+            BUFFER_COPY_CHAR(b, (value)[i], _pos, buf, bufsize);              \
+    } while (0)
+#define BUFFER_COMMIT(b, _pos, buf, bufsize)                                  \
+    do {                                                                      \
+        (b)->pos = BUFFER_OFFSET(b, _pos);                                    \
+        (b)->pending = 0;                                                     \
+        BUFFER_TERMINATE(b, buf, bufsize);                                    \
+    } while (0)
+
+/* none of the optional features is in use (flags, a pending token, a skipped
+ *      value, projections, schema checks), so that builder functions can
+ *      write a whole token with a single bounds check, anything else is left
+ *      to their general path */
+#define FAST_PATH(b, buf)                                                     \
+    ((buf) && !((b)->flags | (b)->pending | (b)->skip) && !(b)->fields        \
+     && !(b)->check)
+/* write 'token' after a ',' if 'comma' is set, both of them and the NUL
+ *      terminator are known to fit */
+#define FAST_COPY(b, buf, comma, token, len)                                  \
+    do {                                                                      \
+        (buf)[(b)->pos] = ',';                                                \
+        memcpy((buf) + (b)->pos + (comma), token, len);                       \
+        (b)->pos += (comma) + (len);                                          \
+        (buf)[(b)->pos] = '\0';                                               \
+    } while (0)
+
+/* while a value that isn't projected is skipped, emitters return right away
+ *      without touching the state: 'skip' is the value's depth plus one */
+#define SKIP_VALUE(b)                                                         \
+    do {                                                                      \
+        if ((b)->skip) {                                                      \
+            if ((b)->skip == 1) (b)->skip = 0;                                \
+            return JSONB_OK;                                                  \
+        }                                                                     \
+    } while (0)
+#define SKIP_PUSH(b)                                                          \
+    do {                                                                      \
+        if ((b)->skip) {                                                      \
+            ++(b)->skip;                                                      \
+            return JSONB_OK;                                                  \
+        }                                                                     \
+    } while (0)
+/* 'dec' is the call's effect on the depth, a key or pop that comes right
+ *      after a skipped key is an error, as it would be if it wasn't skipped */
+#define SKIP_NESTED(b, dec)                                                   \
+    do {                                                                      \
+        if ((b)->skip == 1) {                                                 \
+            (b)->skip = 0;                                                    \
+            STACK_HEAD(b, JSONB_ERROR);                                       \
+            return JSONB_ERROR_INPUT;                                         \
+        }                                                                     \
+        if ((b)->skip) {                                                      \
+            if (((b)->skip -= (dec)) == 1) (b)->skip = 0;                     \
+            return JSONB_OK;                                                  \
+        }                                                                     \
+    } while (0)
+#define STACK_DEPTH(b)     ((size_t)((b)->top - (b)->stack))
+#define DEPTH_BIT(b) (1u << STACK_DEPTH(b) % 8)
+/* a pushed container descends into the projection node of its key */
+#define FIELDS_PUSH(b)                                                        \
+    do {                                                                      \
+        if ((b)->fields && (b)->next_field) {                                 \
+            (b)->field_levels[STACK_DEPTH(b) / 8] |= DEPTH_BIT(b);      \
+            (b)->field = (b)->next_field;                                     \
+            (b)->next_field = 0;                                              \
+        }                                                                     \
+        else if ((b)->fields)                                                 \
+            (b)->field_levels[STACK_DEPTH(b) / 8] &= ~DEPTH_BIT(b);     \
+    } while (0)
+#define FIELDS_POP(b)                                                         \
+    do {                                                                      \
+        if ((b)->fields                                                       \
+            && ((b)->field_levels[STACK_DEPTH(b) / 8] & DEPTH_BIT(b)))  \
+            (b)->field = (b)->fields[(b)->field].parent;                      \
+    } while (0)
+
+/* a pushed container that is an object member keeps its key's offset */
+#define OMIT_PUSH(b, member)                                                  \
+    do {                                                                      \
+        if ((b)->flags & JSONB_OMITEMPTY) {                                   \
+            (b)->omit_marks[STACK_DEPTH(b)] =                                 \
+                (member) ? (b)->omit_mark : (size_t)-1;                       \
+            if ((b)->omit_first)                                              \
+                (b)->omit_firsts[STACK_DEPTH(b) / 8] |= DEPTH_BIT(b);         \
+            else                                                              \
+                (b)->omit_firsts[STACK_DEPTH(b) / 8] &= ~DEPTH_BIT(b);        \
+        }                                                                     \
+    } while (0)
+/* an empty container that is an object member is retracted along with its
+ *      key, rather than closed */
+#define OMIT_POP(b, empty, buf, bufsize)                                      \
+    do {                                                                      \
+        if (((b)->flags & JSONB_OMITEMPTY) && *(b)->top == (empty)           \
+            && (b)->omit_marks[STACK_DEPTH(b)] != (size_t)-1) {               \
+            size_t _mark = (b)->omit_marks[STACK_DEPTH(b)];                   \
+            int _first = ((b)->omit_firsts[STACK_DEPTH(b) / 8]                \
+                          & DEPTH_BIT(b)) != 0;                               \
+            FIELDS_POP(b);                                                    \
+            STACK_POP(b);                                                     \
+            return _jsonb_retract(b, buf, bufsize, _mark, _first);            \
+        }                                                                     \
+    } while (0)
+
+/* check the next value against its schema, 'schema' is set to the value's
+ *      own schema */
+#define CHECK_VALUE(b, type, schema)                                          \
+    do {                                                                      \
+        if ((b)->check) {                                                     \
+            enum jsonbcode _code = _jsonb_check_value(b, type, &(schema));    \
+            if (_code != JSONB_OK) return _code;                              \
+        }                                                                     \
+    } while (0)
+/* the value is written, count it as an item of its container */
+#define CHECK_COUNT(b)                                                        \
+    do {                                                                      \
+        if ((b)->check) ++(b)->check->levels[STACK_DEPTH(b)].count;           \
+    } while (0)
+#define CHECK_PUSH(b, _schema)                                                \
+    do {                                                                      \
+        if ((b)->check) {                                                     \
+            (b)->check->levels[STACK_DEPTH(b)].schema = (_schema);            \
+            (b)->check->levels[STACK_DEPTH(b)].seen = 0;                      \
+            (b)->check->levels[STACK_DEPTH(b)].count = 0;                     \
+        }                                                                     \
+    } while (0)
+#define CHECK_POP(b)                                                          \
+    do {                                                                      \
+        if ((b)->check) {                                                     \
+            enum jsonbcode _code = _jsonb_check_pop(b);                       \
+            if (_code != JSONB_OK) return _code;                              \
+        }                                                                     \
+    } while (0)
+
+static jsonbcode
+_jsonb_schema_error(jsonb *b)
+{
+    STACK_HEAD(b, JSONB_ERROR);
+    return JSONB_ERROR_SCHEMA;
+}
+
+static jsonbcode
+_jsonb_check_value(jsonb *b,
+                   unsigned type,
+                   const struct jsonb_schema **schema)
+{
+    const struct jsonb_check *check = b->check;
+    const struct jsonb_schema *parent = check->levels[STACK_DEPTH(b)].schema;
+    *schema = NULL;
+    switch (*b->top) {
+    case JSONB_ARRAY_OR_OBJECT_OR_VALUE:
+        *schema = check->root;
+        break;
+    case JSONB_OBJECT_VALUE:
+        if (check->member) *schema = check->member->schema;
+        break;
+    case JSONB_ARRAY_VALUE_OR_CLOSE:
+    case JSONB_ARRAY_NEXT_VALUE_OR_CLOSE:
+        if (!parent) break;
+        if (parent->max_items
+            && check->levels[STACK_DEPTH(b)].count >= parent->max_items)
+            return _jsonb_schema_error(b);
+        *schema = parent->items;
+        break;
+    default: /* left for the builder function to handle */
+        break;
+    }
+    /* raw tokens are of any type */
+    if (*schema && (*schema)->types && type && !((*schema)->types & type))
+        return _jsonb_schema_error(b);
+    return JSONB_OK;
+}
+
+static jsonbcode
+_jsonb_check_pop(jsonb *b)
+{
+    const struct jsonb_schema *schema =
+        b->check->levels[STACK_DEPTH(b)].schema;
+    unsigned long seen = b->check->levels[STACK_DEPTH(b)].seen;
+    size_t i;
+    if (!schema) return JSONB_OK;
+    if (*b->top == JSONB_ARRAY_VALUE_OR_CLOSE
+        || *b->top == JSONB_ARRAY_NEXT_VALUE_OR_CLOSE)
+        return b->check->levels[STACK_DEPTH(b)].count < schema->min_items
+                   ? _jsonb_schema_error(b)
+                   : JSONB_OK;
+    for (i = 0; i < schema->nmembers && i < JSONB_SCHEMA_REQUIRED_MAX; ++i)
+        if (schema->members[i].required && !(seen & 1UL << i))
+            return _jsonb_schema_error(b);
+    return JSONB_OK;
+}
+
+/* restore the state from before an object member's key was written */
+static jsonbcode
+_jsonb_retract(jsonb *b, char buf[], size_t bufsize, size_t mark, int first)
+{
+    b->pos = mark;
+    STACK_HEAD(b, first ? JSONB_OBJECT_KEY_OR_CLOSE
+                        : JSONB_OBJECT_NEXT_KEY_OR_CLOSE);
+    b->next_field = 0;
+    /* a retracted required member is missing again */
+    if (b->check)
+        b->check->levels[STACK_DEPTH(b)].seen =
+            b->check->levels[STACK_DEPTH(b)].omit_seen;
+    BUFFER_TERMINATE(b, buf, bufsize);
+    return JSONB_OK;
+}
+
+/* whether the empty value of an object member has been omitted */
+static int
+_jsonb_omit(jsonb *b, char buf[], size_t bufsize)
+{
+    if (!(b->flags & JSONB_OMITEMPTY) || *b->top != JSONB_OBJECT_VALUE
+        || b->omit_mark == (size_t)-1)
+        return 0;
+    _jsonb_retract(b, buf, bufsize, b->omit_mark, b->omit_first);
+    return 1;
+}
+
+static jsonbcode
+_jsonb_nomem(jsonb *b, char buf[], size_t bufsize, size_t pos)
+{
+    if ((b->flags & JSONB_TRUNCATE) && b->top != b->stack) {
+        /* drop the token, there is always room left to close the JSON */
+        b->pending = 0;
+        b->reserve = 0;
+        b->flags |= JSONB_TRUNCATED;
+        return jsonb_close_all(b, buf, bufsize);
+    }
+    if (!(b->flags & JSONB_NONBLOCK)) {
+        BUFFER_TERMINATE(b, buf, bufsize);
+        return JSONB_ERROR_NOMEM;
+    }
+    /* keep what has been written so far, and resume from it next call */
+    b->pos = BUFFER_OFFSET(b, pos);
+    b->pending = pos;
+    BUFFER_TERMINATE(b, buf, bufsize);
+    return JSONB_ERROR_WOULDBLOCK;
+}
+
+/* state that follows a value pushed in the current state, 'comma' is set if
+ *      it must be preceded by a ',', JSONB_ERROR if it isn't allowed (left to
+ *      the general path to report) */
+static enum jsonbstate
+_jsonb_next_value(const jsonb *b, size_t *comma)
+{
+    *comma = 0;
+    switch (*b->top) {
+    case JSONB_ARRAY_NEXT_VALUE_OR_CLOSE:
+        *comma = 1;
+        /* fall-through */
+    case JSONB_ARRAY_VALUE_OR_CLOSE:
+        return JSONB_ARRAY_NEXT_VALUE_OR_CLOSE;
+    case JSONB_OBJECT_VALUE:
+        return JSONB_OBJECT_NEXT_KEY_OR_CLOSE;
+    case JSONB_ARRAY_OR_OBJECT_OR_VALUE:
+        return JSONB_DONE;
+    default:
+        return JSONB_ERROR;
+    }
+}
+
+JSONB_API void
+jsonb_init(jsonb *b)
+{
+    /* stack slots above 'top' are always written before being read, so
+     *      there is no need to clear the whole stack for every document */
+    b->top = b->stack;
+    STACK_HEAD(b, JSONB_INIT);
+    b->pos = 0;
+    b->flags = 0;
+    b->pending = 0;
+    b->resume_src = b->resume_pos = 0;
+    b->reserve = 0;
+    /* per-depth bits and marks are written by every push before being read */
+    b->fields = NULL;
+    b->field = b->next_field = 0;
+    b->skip = 0;
+    b->omit_mark = 0;
+    b->omit_first = 0;
+    b->check = NULL;
+}
+
+static int
+_jsonb_key_eq(const char a[], size_t alen, const char b[], size_t blen)
+{
+    size_t i;
+    if (alen != blen) return 0;
+    for (i = 0; i < alen && a[i] == b[i]; ++i)
+        continue;
+    return i == alen;
+}
+
+/* byte of the escaped key 'key' at '*i', moving '*i' past it, or -1 for an
+ *      escape that jsonb_escape() doesn't write (other than '\/') */
+static int
+_jsonb_unescape_next(const char key[], size_t len, size_t *i)
+{
+    static const char from[] = "\"\\/bfnrt", to[] = "\"\\/\b\f\n\r\t";
+    unsigned c = 0;
+    size_t k;
+    if (key[*i] != '\\') return (unsigned char)key[(*i)++];
+    if (*i + 1 == len) return -1;
+    for (k = 0; from[k]; ++k)
+        if (key[*i + 1] == from[k]) {
+            *i += 2;
+            return (unsigned char)to[k];
+        }
+    if (key[*i + 1] != 'u' || len - *i < 6) return -1;
+    for (k = 2; k < 6; ++k) {
+        char h = key[*i + k];
+        if (h >= '0' && h <= '9')
+            c = c << 4 | (unsigned)(h - '0');
+        else if ((h | 0x20) >= 'a' && (h | 0x20) <= 'f')
+            c = c << 4 | (unsigned)((h | 0x20) - 'a' + 10);
+        else
+            return -1;
+    }
+    if (c > 0x7F) return -1;
+    *i += 6;
+    return (int)c;
+}
+
+/* compare 'a' to 'b', unescaping 'b' first if 'raw' is set */
+static int
+_jsonb_key_match(
+    const char a[], size_t alen, const char b[], size_t blen, int raw)
+{
+    size_t i = 0, j = 0;
+    if (!raw) return _jsonb_key_eq(a, alen, b, blen);
+    while (i < blen) {
+        int c = _jsonb_unescape_next(b, blen, &i);
+        if (c < 0 || j == alen || (unsigned char)a[j] != (unsigned)c)
+            return 0;
+        ++j;
+    }
+    return j == alen;
+}
+
+/* index of the subfield of 'parent' named 'key', 0 if there is none */
+static size_t
+_jsonb_field_child(const struct jsonb_field fields[],
+                   size_t parent,
+                   const char key[],
+                   size_t len,
+                   int raw)
+{
+    size_t i;
+    for (i = fields[parent].child; i; i = fields[i].next)
+        if (_jsonb_key_match(fields[i].key, fields[i].len, key, len, raw))
+            return i;
+    return 0;
+}
+
+/* 32-bit FNV-1a of 'key', unescaped first if 'raw' is set */
+static unsigned long
+_jsonb_hash(const char key[], size_t len, unsigned long seed, int raw)
+{
+    unsigned long h = (2166136261UL ^ seed) & 0xFFFFFFFFUL;
+    size_t i = 0;
+    while (i < len) {
+        int c = raw ? _jsonb_unescape_next(key, len, &i)
+                    : (unsigned char)key[i++];
+        /* won't match anyway */
+        if (c < 0) c = (unsigned char)key[i++];
+        h = ((h ^ (unsigned)c) * 16777619UL) & 0xFFFFFFFFUL;
+    }
+    return h;
+}
+
+/* member of 'schema' named 'key', NULL if there is none */
+static const struct jsonb_schema_member *
+_jsonb_schema_find(const struct jsonb_schema *schema,
+                   const char key[],
+                   size_t len,
+                   int raw)
+{
+    const struct jsonb_schema_member *m;
+    size_t i;
+    if (!schema->tablesize) {
+        for (i = 0; i < schema->nmembers; ++i)
+            if (_jsonb_key_match(schema->members[i].key,
+                                 schema->members[i].len, key, len, raw))
+                return schema->members + i;
+        return NULL;
+    }
+    i = schema->table[_jsonb_hash(key, len, schema->seed, raw)
+                      % schema->tablesize];
+    if (!i) return NULL;
+    m = schema->members + i - 1;
+    return _jsonb_key_match(m->key, m->len, key, len, raw) ? m : NULL;
+}
+
+JSONB_API jsonbcode
+jsonb_schema_compile(struct jsonb_schema *schema,
+                     size_t table[],
+                     size_t tablesize)
+{
+    const struct jsonb_schema_member *members = schema->members;
+    size_t n = schema->nmembers, i, j;
+    unsigned long seed;
+    for (i = 0; i < n; ++i) {
+        if (members[i].required && i >= JSONB_SCHEMA_REQUIRED_MAX)
+            return JSONB_ERROR_INPUT;
+        for (j = 0; j < i; ++j)
+            if (_jsonb_key_eq(members[i].key, members[i].len, members[j].key,
+                              members[j].len))
+                return JSONB_ERROR_INPUT;
+    }
+    if (tablesize < n || !tablesize) return JSONB_ERROR_NOMEM;
+    for (seed = 0; seed < JSONB_SCHEMA_SEEDS; ++seed) {
+        for (i = 0; i < tablesize; ++i)
+            table[i] = 0;
+        for (i = 0; i < n; ++i) {
+            size_t *slot =
+                table
+                + _jsonb_hash(members[i].key, members[i].len, seed, 0)
+                      % tablesize;
+            if (*slot) break;
+            *slot = i + 1;
+        }
+        if (i == n) {
+            schema->table = table;
+            schema->tablesize = tablesize;
+            schema->seed = seed;
+            return JSONB_OK;
+        }
+    }
+    return JSONB_ERROR_NOMEM;
+}
+
+JSONB_API void
+jsonb_check_init(struct jsonb_check *check, const struct jsonb_schema *root)
+{
+    check->root = root;
+    check->member = NULL;
+    check->levels[0].schema = NULL;
+    check->levels[0].seen = 0;
+    check->levels[0].count = 0;
+}
+
+/* projection node of 'key' in the current object, 0 if the current node
+ *      has no subfields (all of its keys are wanted), or (size_t)-1 if the
+ *      key isn't projected, 'raw' is set if 'key' is escaped */
+static size_t
+_jsonb_field_find(const jsonb *b, const char key[], size_t len, int raw)
+{
+    size_t node;
+    if (!b->fields[b->field].child) return 0;
+    node = _jsonb_field_child(b->fields, b->field, key, len, raw);
+    return node ? node : (size_t)-1;
+}
+
+/* parse a selector key along with its subfields, or a comma separated list
+ *      of those if 'list' is set */
+static jsonbcode
+_jsonb_fields_parse(struct jsonb_field fields[],
+                    size_t nfields,
+                    size_t *n,
+                    size_t parent,
+                    const char **p,
+                    const char *end,
+                    int list,
+                    int depth)
+{
+    for (;;) {
+        const char *key = *p;
+        enum jsonbcode code;
+        size_t node;
+        char c;
+        while (*p != end && **p != ',' && **p != '/' && **p != '('
+               && **p != ')')
+            ++*p;
+        if (*p == key) return JSONB_ERROR_INPUT;
+        node = _jsonb_field_child(fields, parent, key, *p - key, 0);
+        if (!node) {
+            if (*n == nfields) return JSONB_ERROR_NOMEM;
+            node = (*n)++;
+            fields[node].key = key;
+            fields[node].len = *p - key;
+            fields[node].parent = parent;
+            fields[node].child = 0;
+            fields[node].next = fields[parent].child;
+            fields[parent].child = node;
+        }
+        c = *p != end ? **p : '\0';
+        if (c == '/' || c == '(') {
+            if (depth >= JSONB_MAX_DEPTH) return JSONB_ERROR_STACK;
+            ++*p;
+            code = _jsonb_fields_parse(fields, nfields, n, node, p, end,
+                                       c == '(', depth + 1);
+            if (code != JSONB_OK) return code;
+            if (c == '(') {
+                if (*p == end || **p != ')') return JSONB_ERROR_INPUT;
+                ++*p;
+            }
+        }
+        if (!list || *p == end || **p != ',') return JSONB_OK;
+        ++*p;
+    }
+}
+
+JSONB_API long
+jsonb_fields_compile(struct jsonb_field fields[],
+                     size_t nfields,
+                     const char selector[],
+                     size_t len)
+{
+    const char *p = selector, *end = selector + len;
+    enum jsonbcode code;
+    size_t n = 1;
+    if (!nfields) return JSONB_ERROR_NOMEM;
+    fields[0].key = NULL;
+    fields[0].len = fields[0].parent = fields[0].child = fields[0].next = 0;
+    if (!len) return 1;
+    code = _jsonb_fields_parse(fields, nfields, &n, 0, &p, end, 1, 1);
+    if (code != JSONB_OK) return code;
+    /* e.g. an unbalanced ')' */
+    if (p != end) return JSONB_ERROR_INPUT;
+    return (long)n;
+}
+
+JSONB_API int
+jsonb_wanted(const jsonb *b, const char key[], size_t len)
+{
+    if (b->skip) return 0;
+    if (!b->fields) return 1;
+    return _jsonb_field_find(b, key, len, 0) != (size_t)-1;
+}
+
+JSONB_API jsonbcode
+jsonb_object(jsonb *b, char buf[], size_t bufsize)
+{
+    const struct jsonb_schema *schema = NULL;
+    enum jsonbstate new_state;
+    size_t pos = 0;
+    if (FAST_PATH(b, buf) && b->top - b->stack < JSONB_MAX_DEPTH) {
+        size_t comma;
+        new_state = _jsonb_next_value(b, &comma);
+        if (new_state != JSONB_ERROR && b->pos + comma + 1 < bufsize) {
+            FAST_COPY(b, buf, comma, "{", 1);
+            STACK_HEAD(b, new_state);
+            STACK_PUSH(b, JSONB_OBJECT_KEY_OR_CLOSE);
+            return JSONB_OK;
+        }
+    }
+    SKIP_PUSH(b);
+    if (b->top - b->stack >= JSONB_MAX_DEPTH) return JSONB_ERROR_STACK;
+    CHECK_VALUE(b, JSONB_TYPE_OBJECT, schema);
+    BUFFER_RESERVE(b, 1);
+    switch (*b->top) {
+    case JSONB_ARRAY_NEXT_VALUE_OR_CLOSE:
+        BUFFER_COPY_CHAR(b, ',', pos, buf, bufsize);
+        /* fall-through */
+    case JSONB_ARRAY_VALUE_OR_CLOSE:
+        new_state = JSONB_ARRAY_NEXT_VALUE_OR_CLOSE;
+        break;
+    case JSONB_OBJECT_VALUE:
+        new_state = JSONB_OBJECT_NEXT_KEY_OR_CLOSE;
+        break;
+    case JSONB_ARRAY_OR_OBJECT_OR_VALUE:
+        new_state = JSONB_DONE;
+        break;
+    default:
+        STACK_HEAD(b, JSONB_ERROR);
+        /* fall-through */
+    case JSONB_DONE:
+    case JSONB_ERROR:
+        return DONE_CODE(b);
+    }
+    BUFFER_COPY_CHAR(b, '{', pos, buf, bufsize);
+    STACK_HEAD(b, new_state);
+    CHECK_COUNT(b);
+    STACK_PUSH(b, JSONB_OBJECT_KEY_OR_CLOSE);
+    CHECK_PUSH(b, schema);
+    FIELDS_PUSH(b);
+    OMIT_PUSH(b, new_state == JSONB_OBJECT_NEXT_KEY_OR_CLOSE);
+    BUFFER_COMMIT(b, pos, buf, bufsize);
+    return JSONB_OK;
+}
+
+JSONB_API jsonbcode
+jsonb_object_pop(jsonb *b, char buf[], size_t bufsize)
+{
+    enum jsonbcode code;
     size_t pos = 0;
+    if (FAST_PATH(b, buf)
+        && (*b->top == JSONB_OBJECT_KEY_OR_CLOSE
+            || *b->top == JSONB_OBJECT_NEXT_KEY_OR_CLOSE)
+        && b->pos + 1 < bufsize) {
+        FAST_COPY(b, buf, 0, "}", 1);
+        STACK_POP(b);
+        return b->top == b->stack ? JSONB_END : JSONB_OK;
+    }
+    SKIP_NESTED(b, 1);
+    BUFFER_RESERVE(b, -1);
+    switch (*b->top) {
+    case JSONB_OBJECT_KEY_OR_CLOSE:
+    case JSONB_OBJECT_NEXT_KEY_OR_CLOSE:
+        code = b->stack == b->top - 1 ? JSONB_END : JSONB_OK;
+        break;
+    default:
+        STACK_HEAD(b, JSONB_ERROR);
+        /* fall-through */
+    case JSONB_DONE:
+    case JSONB_ERROR:
+        return DONE_CODE(b);
+    }
+    CHECK_POP(b);
+    OMIT_POP(b, JSONB_OBJECT_KEY_OR_CLOSE, buf, bufsize);
+    BUFFER_COPY_CHAR(b, '}', pos, buf, bufsize);
+    FIELDS_POP(b);
+    STACK_POP(b);
+    BUFFER_COMMIT(b, pos, buf, bufsize);
+    return code;
+}
+
+/* write the escape sequence of 'c' to 'seq', returns its length */
+static int
+_jsonb_escape_char(unsigned char c, char seq[6])
+{
+    static const char tohex[] = "0123456789abcdef";
+    seq[0] = '\\';
+    switch (c) {
+    case 0x22: seq[1] = '"'; return 2;
+    case 0x5C: seq[1] = '\\'; return 2;
+    case '\b': seq[1] = 'b'; return 2;
+    case '\f': seq[1] = 'f'; return 2;
+    case '\n': seq[1] = 'n'; return 2;
+    case '\r': seq[1] = 'r'; return 2;
+    case '\t': seq[1] = 't'; return 2;
+    default:
+        if (c > 0x1F) {
+            seq[0] = c;
+            return 1;
+        }
+        seq[1] = 'u';
+        seq[2] = seq[3] = '0';
+        seq[4] = tohex[c >> 4];
+        seq[5] = tohex[c & 0xF];
+        return 6;
+    }
+}
+
+static jsonbcode
+_jsonb_escape(jsonb *b,
+              size_t *pos,
+              char buf[],
+              size_t bufsize,
+              const char str[],
+              size_t len)
+{
+    size_t i = 0;
+    /* jump right to where a JSONB_ERROR_WOULDBLOCK call has stopped, so that
+     *      resuming doesn't rescan what has already been written */
+    if (b->pending > *pos && b->resume_pos >= *pos) {
+        i = b->resume_src;
+        *pos = b->resume_pos;
+    }
+    for (; i < len; ++i) {
+        char seq[6];
+        int k, n = _jsonb_escape_char(str[i], seq);
+        for (k = 0; k < n; ++k) {
+            if (buf && *pos >= b->pending) {
+                if (BUFFER_OFFSET(b, *pos) + 1 + BUFFER_TAIL(b) > bufsize) {
+                    b->resume_src = i;
+                    b->resume_pos = *pos - k;
+                    return _jsonb_nomem(b, buf, bufsize, *pos);
+                }
+                buf[BUFFER_OFFSET(b, *pos)] = seq[k];
+            }
+            ++*pos;
+        }
+    }
+    b->resume_src = len;
+    b->resume_pos = *pos;
+    return JSONB_OK;
+}
+
+/* length of the escape sequence of 'c' */
+static size_t
+_jsonb_escape_len(unsigned char c)
+{
+    if (c == 0x22 || c == 0x5C) return 2;
+    if (c > 0x1F) return 1;
+    if (c == '\b' || c == '\f' || c == '\n' || c == '\r' || c == '\t')
+        return 2;
+    return 6;
+}
+
+/* amount of leading bytes of 'str' that fit 'room' once escaped, or of an
+ *      escaped 'str' without splitting its escape sequences */
+static size_t
+_jsonb_escape_fit(const char str[], size_t len, size_t room, int escape)
+{
+    size_t i = 0, n = 0;
+    while (i < len) {
+        size_t step = 1, k = 1;
+        if (escape)
+            k = _jsonb_escape_len(str[i]);
+        else if (str[i] == '\\')
+            step = k = i + 1 < len && str[i + 1] == 'u' ? 6 : 2;
+        if (n + k > room) break;
+        n += k;
+        i += step;
+    }
+    return i < len ? i : len;
+}
+
+JSONB_API size_t
+jsonb_escaped_len(const char str[], size_t len)
+{
+    size_t i, n = 0;
+    for (i = 0; i < len; ++i)
+        n += _jsonb_escape_len(str[i]);
+    return n;
+}
+
+JSONB_API size_t
+jsonb_escape(char dest[], const char str[], size_t len)
+{
+    size_t i, n = 0;
+    for (i = 0; i < len; ++i) {
+        unsigned char c = str[i];
+        if (c > 0x1F && c != 0x22 && c != 0x5C)
+            dest[n++] = c;
+        else
+            n += _jsonb_escape_char(c, dest + n);
+    }
+    return n;
+}
+
+/* 'escape' is unset for keys that have been escaped beforehand */
+static jsonbcode
+_jsonb_key(jsonb *b,
+           char buf[],
+           size_t bufsize,
+           const char key[],
+           size_t len,
+           int escape)
+{
+    const struct jsonb_schema_member *member = NULL;
+    size_t pos = 0;
+    if (FAST_PATH(b, buf)
+        && (*b->top == JSONB_OBJECT_KEY_OR_CLOSE
+            || *b->top == JSONB_OBJECT_NEXT_KEY_OR_CLOSE)) {
+        size_t comma = *b->top == JSONB_OBJECT_NEXT_KEY_OR_CLOSE;
+        size_t room = b->pos < bufsize ? bufsize - b->pos : 0;
+        /* room for the quotes, ':' and NUL, and the key's worst case */
+        if (room >= comma + 4 && len <= (room - comma - 4) / (escape ? 6 : 1)) {
+            char *p = buf + b->pos;
+            *p = ',';
+            p += comma;
+            *p++ = '"';
+            if (escape)
+                p += jsonb_escape(p, key, len);
+            else {
+                memcpy(p, key, len);
+                p += len;
+            }
+            *p++ = '"';
+            *p++ = ':';
+            *p = '\0';
+            b->pos = p - buf;
+            STACK_HEAD(b, JSONB_OBJECT_VALUE);
+            return JSONB_OK;
+        }
+    }
+    SKIP_NESTED(b, 0);
+    if (b->fields
+        && (*b->top == JSONB_OBJECT_KEY_OR_CLOSE
+            || *b->top == JSONB_OBJECT_NEXT_KEY_OR_CLOSE)) {
+        size_t node = _jsonb_field_find(b, key, len, !escape);
+        if (node == (size_t)-1) {
+            b->skip = 1;
+            return JSONB_OK;
+        }
+        b->next_field = node;
+    }
+    if (b->check
+        && (*b->top == JSONB_OBJECT_KEY_OR_CLOSE
+            || *b->top == JSONB_OBJECT_NEXT_KEY_OR_CLOSE)) {
+        const struct jsonb_schema *schema =
+            b->check->levels[STACK_DEPTH(b)].schema;
+        if (schema && schema->members) {
+            member = _jsonb_schema_find(schema, key, len, !escape);
+            if (!member) return _jsonb_schema_error(b);
+        }
+    }
+    if ((b->flags & JSONB_OMITEMPTY) && !b->pending) {
+        b->omit_mark = b->pos;
+        b->omit_first = *b->top == JSONB_OBJECT_KEY_OR_CLOSE;
+    }
+    BUFFER_RESERVE(b, sizeof("null") - 1);
     switch (*b->top) {
     case JSONB_OBJECT_NEXT_KEY_OR_CLOSE:
         BUFFER_COPY_CHAR(b, ',', pos, buf, bufsize);
@@ -400,27 +2089,69 @@ jsonb_key(jsonb *b, char buf[], size_t bufsize, const char key[], size_t len)
     case JSONB_OBJECT_KEY_OR_CLOSE: {
         enum jsonbcode ret;
         BUFFER_COPY_CHAR(b, '"', pos, buf, bufsize);
-        ret = _jsonb_escape(&pos, buf + b->pos, bufsize, key, len);
-        if (ret != JSONB_OK) return ret;
+        if (escape) {
+            ret = _jsonb_escape(b, &pos, buf, bufsize, key, len);
+            if (ret != JSONB_OK) return ret;
+        }
+        else
+            BUFFER_COPY(b, key, len, pos, buf, bufsize);
         BUFFER_COPY(b, "\":", 2, pos, buf, bufsize);
         STACK_HEAD(b, JSONB_OBJECT_VALUE);
+        if (b->check) {
+            b->check->member = member;
+            b->check->levels[STACK_DEPTH(b)].omit_seen =
+                b->check->levels[STACK_DEPTH(b)].seen;
+            if (member) {
+                size_t i = member
+                           - b->check->levels[STACK_DEPTH(b)].schema->members;
+                if (i < JSONB_SCHEMA_REQUIRED_MAX)
+                    b->check->levels[STACK_DEPTH(b)].seen |= 1UL << i;
+            }
+        }
     } break;
     default:
         STACK_HEAD(b, JSONB_ERROR);
         /* fall-through */
     case JSONB_DONE:
-        return JSONB_ERROR_INPUT;
+        return DONE_CODE(b);
     }
-    b->pos += pos;
+    BUFFER_COMMIT(b, pos, buf, bufsize);
     return JSONB_OK;
 }
 
+JSONB_API jsonbcode
+jsonb_key(jsonb *b, char buf[], size_t bufsize, const char key[], size_t len)
+{
+    return _jsonb_key(b, buf, bufsize, key, len, 1);
+}
+
+JSONB_API jsonbcode
+jsonb_key_raw(
+    jsonb *b, char buf[], size_t bufsize, const char key[], size_t len)
+{
+    return _jsonb_key(b, buf, bufsize, key, len, 0);
+}
+
 JSONB_API jsonbcode
 jsonb_array(jsonb *b, char buf[], size_t bufsize)
 {
+    const struct jsonb_schema *schema = NULL;
     enum jsonbstate new_state;
     size_t pos = 0;
+    if (FAST_PATH(b, buf) && b->top - b->stack < JSONB_MAX_DEPTH) {
+        size_t comma;
+        new_state = _jsonb_next_value(b, &comma);
+        if (new_state != JSONB_ERROR && b->pos + comma + 1 < bufsize) {
+            FAST_COPY(b, buf, comma, "[", 1);
+            STACK_HEAD(b, new_state);
+            STACK_PUSH(b, JSONB_ARRAY_VALUE_OR_CLOSE);
+            return JSONB_OK;
+        }
+    }
+    SKIP_PUSH(b);
     if (b->top - b->stack >= JSONB_MAX_DEPTH) return JSONB_ERROR_STACK;
+    CHECK_VALUE(b, JSONB_TYPE_ARRAY, schema);
+    BUFFER_RESERVE(b, 1);
     switch (*b->top) {
     case JSONB_ARRAY_NEXT_VALUE_OR_CLOSE:
         BUFFER_COPY_CHAR(b, ',', pos, buf, bufsize);
@@ -439,12 +2170,16 @@ jsonb_array(jsonb *b, char buf[], size_t bufsize)
         /* fall-through */
     case JSONB_DONE:
     case JSONB_ERROR:
-        return JSONB_ERROR_INPUT;
+        return DONE_CODE(b);
     }
     BUFFER_COPY_CHAR(b, '[', pos, buf, bufsize);
     STACK_HEAD(b, new_state);
+    CHECK_COUNT(b);
     STACK_PUSH(b, JSONB_ARRAY_VALUE_OR_CLOSE);
-    b->pos += pos;
+    CHECK_PUSH(b, schema);
+    FIELDS_PUSH(b);
+    OMIT_PUSH(b, new_state == JSONB_OBJECT_NEXT_KEY_OR_CLOSE);
+    BUFFER_COMMIT(b, pos, buf, bufsize);
     return JSONB_OK;
 }
 
@@ -453,6 +2188,16 @@ jsonb_array_pop(jsonb *b, char buf[], size_t bufsize)
 {
     enum jsonbcode code;
     size_t pos = 0;
+    if (FAST_PATH(b, buf)
+        && (*b->top == JSONB_ARRAY_VALUE_OR_CLOSE
+            || *b->top == JSONB_ARRAY_NEXT_VALUE_OR_CLOSE)
+        && b->pos + 1 < bufsize) {
+        FAST_COPY(b, buf, 0, "]", 1);
+        STACK_POP(b);
+        return b->top == b->stack ? JSONB_END : JSONB_OK;
+    }
+    SKIP_NESTED(b, 1);
+    BUFFER_RESERVE(b, -1);
     switch (*b->top) {
     case JSONB_ARRAY_VALUE_OR_CLOSE:
     case JSONB_ARRAY_NEXT_VALUE_OR_CLOSE:
@@ -463,21 +2208,88 @@ jsonb_array_pop(jsonb *b, char buf[], size_t bufsize)
         /* fall-through */
     case JSONB_DONE:
     case JSONB_ERROR:
-        return JSONB_ERROR_INPUT;
+        return DONE_CODE(b);
     }
+    CHECK_POP(b);
+    OMIT_POP(b, JSONB_ARRAY_VALUE_OR_CLOSE, buf, bufsize);
     BUFFER_COPY_CHAR(b, ']', pos, buf, bufsize);
+    FIELDS_POP(b);
     STACK_POP(b);
-    b->pos += pos;
+    BUFFER_COMMIT(b, pos, buf, bufsize);
     return code;
 }
 
 JSONB_API jsonbcode
-jsonb_token(
-    jsonb *b, char buf[], size_t bufsize, const char token[], size_t len)
+jsonb_array_extend(jsonb *b, char buf[], size_t bufsize, size_t len)
 {
+    if (b->skip) return JSONB_OK;
+    BUFFER_RESERVE(b, 0);
+    switch (*b->top) {
+    case JSONB_ARRAY_VALUE_OR_CLOSE:
+    case JSONB_ARRAY_NEXT_VALUE_OR_CLOSE:
+        break;
+    default:
+        STACK_HEAD(b, JSONB_ERROR);
+        /* fall-through */
+    case JSONB_DONE:
+    case JSONB_ERROR:
+        return DONE_CODE(b);
+    }
+    if (!len) return JSONB_OK;
+    /* the elements are left untouched, so that the call can be retried */
+    if (buf && b->pos + len + BUFFER_TAIL(b) > bufsize)
+        return JSONB_ERROR_NOMEM;
+    /* first element, there is nothing to be separated from */
+    if (buf && *b->top == JSONB_ARRAY_VALUE_OR_CLOSE && buf[b->pos] == ',')
+        buf[b->pos] = ' ';
+    STACK_HEAD(b, JSONB_ARRAY_NEXT_VALUE_OR_CLOSE);
+    b->pos += len;
+    BUFFER_TERMINATE(b, buf, bufsize);
+    return JSONB_OK;
+}
+
+JSONB_API size_t
+jsonb_numbers(char dest[], const double numbers[], size_t n)
+{
+    size_t i, len = 0;
+    for (i = 0; i < n; ++i) {
+        /* formatted apart, so that the NUL doesn't clobber what follows */
+        char token[32];
+        int k, m = sprintf(token, ",%.17G", numbers[i]);
+        if (dest)
+            for (k = 0; k < m; ++k)
+                dest[len + k] = token[k];
+        len += m;
+    }
+    return len;
+}
+
+/* 'type' is the token's @ref jsonbtype, 0 if unknown */
+static jsonbcode
+_jsonb_token(jsonb *b,
+             char buf[],
+             size_t bufsize,
+             const char token[],
+             size_t len,
+             unsigned type)
+{
+    const struct jsonb_schema *schema;
     enum jsonbstate next_state;
     enum jsonbcode code;
     size_t pos = 0;
+    if (FAST_PATH(b, buf)) {
+        size_t comma;
+        next_state = _jsonb_next_value(b, &comma);
+        if (next_state != JSONB_ERROR && len < bufsize
+            && b->pos + comma < bufsize - len) {
+            FAST_COPY(b, buf, comma, token, len);
+            STACK_HEAD(b, next_state);
+            return next_state == JSONB_DONE ? JSONB_END : JSONB_OK;
+        }
+    }
+    SKIP_VALUE(b);
+    CHECK_VALUE(b, type, schema);
+    BUFFER_RESERVE(b, 0);
     switch (*b->top) {
     case JSONB_ARRAY_OR_OBJECT_OR_VALUE:
         next_state = JSONB_DONE;
@@ -499,34 +2311,82 @@ jsonb_token(
         /* fall-through */
     case JSONB_DONE:
     case JSONB_ERROR:
-        return JSONB_ERROR_INPUT;
+        return DONE_CODE(b);
     }
     BUFFER_COPY(b, token, len, pos, buf, bufsize);
     STACK_HEAD(b, next_state);
-    b->pos += pos;
+    CHECK_COUNT(b);
+    b->next_field = 0;
+    BUFFER_COMMIT(b, pos, buf, bufsize);
     return code;
 }
 
+JSONB_API jsonbcode
+jsonb_token(
+    jsonb *b, char buf[], size_t bufsize, const char token[], size_t len)
+{
+    return _jsonb_token(b, buf, bufsize, token, len, 0);
+}
+
 JSONB_API jsonbcode
 jsonb_bool(jsonb *b, char buf[], size_t bufsize, int boolean)
 {
-    if (boolean) return jsonb_token(b, buf, bufsize, "true", 4);
-    return jsonb_token(b, buf, bufsize, "false", 5);
+    if (boolean)
+        return _jsonb_token(b, buf, bufsize, "true", 4, JSONB_TYPE_BOOL);
+    return _jsonb_token(b, buf, bufsize, "false", 5, JSONB_TYPE_BOOL);
 }
 
 JSONB_API jsonbcode
 jsonb_null(jsonb *b, char buf[], size_t bufsize)
 {
-    return jsonb_token(b, buf, bufsize, "null", 4);
+    if (_jsonb_omit(b, buf, bufsize)) return JSONB_OK;
+    return _jsonb_token(b, buf, bufsize, "null", 4, JSONB_TYPE_NULL);
 }
 
-JSONB_API jsonbcode
-jsonb_string(
-    jsonb *b, char buf[], size_t bufsize, const char str[], size_t len)
+/* 'escape' is unset for strings that have been escaped beforehand */
+static jsonbcode
+_jsonb_string(jsonb *b,
+              char buf[],
+              size_t bufsize,
+              const char str[],
+              size_t len,
+              int escape)
 {
     enum jsonbstate next_state;
     enum jsonbcode code, ret;
     size_t pos = 0;
+    const struct jsonb_schema *schema;
+    int truncated = 0;
+    if (FAST_PATH(b, buf)) {
+        size_t comma, room, max;
+        next_state = _jsonb_next_value(b, &comma);
+        room = b->pos < bufsize ? bufsize - b->pos : 0;
+        /* room for the string once escaped, without quotes and NUL */
+        max = room >= comma + 3 ? room - comma - 3 : 0;
+        if (next_state != JSONB_ERROR
+            && (len <= max / (escape ? 6 : 1)
+                || (len <= max && jsonb_escaped_len(str, len) <= max))) {
+            char *p = buf + b->pos;
+            *p = ',';
+            p += comma;
+            *p++ = '"';
+            if (escape)
+                p += jsonb_escape(p, str, len);
+            else {
+                memcpy(p, str, len);
+                p += len;
+            }
+            *p++ = '"';
+            *p = '\0';
+            b->pos = p - buf;
+            STACK_HEAD(b, next_state);
+            return next_state == JSONB_DONE ? JSONB_END : JSONB_OK;
+        }
+    }
+    SKIP_VALUE(b);
+    if (!len && _jsonb_omit(b, buf, bufsize)) return JSONB_OK;
+    CHECK_VALUE(b, JSONB_TYPE_STRING, schema);
+    BUFFER_RESERVE(b, 0);
     switch (*b->top) {
     case JSONB_ARRAY_OR_OBJECT_OR_VALUE:
         next_state = JSONB_DONE;
@@ -548,24 +2408,1143 @@ jsonb_string(
         /* fall-through */
     case JSONB_DONE:
     case JSONB_ERROR:
-        return JSONB_ERROR_INPUT;
+        return DONE_CODE(b);
+    }
+    if (buf && (b->flags & JSONB_TRUNCATE)) {
+        const size_t marker_len = sizeof(JSONB_TRUNCATE_MARKER) - 1;
+        /* room left for the string contents, without its quotes */
+        size_t used = b->pos + pos + 2 + BUFFER_TAIL(b);
+        size_t room = used < bufsize ? bufsize - used : 0;
+        if (room >= marker_len
+            && _jsonb_escape_fit(str, len, room, escape) < len) {
+            len = _jsonb_escape_fit(str, len, room - marker_len, escape);
+            /* don't split a UTF-8 sequence */
+            while (len && ((unsigned char)str[len] & 0xC0) == 0x80)
+                --len;
+            truncated = 1;
+        }
     }
     BUFFER_COPY_CHAR(b, '"', pos, buf, bufsize);
-    ret = _jsonb_escape(&pos, buf + b->pos, bufsize, str, len);
-    if (ret != JSONB_OK) return ret;
+    if (escape) {
+        ret = _jsonb_escape(b, &pos, buf, bufsize, str, len);
+        if (ret != JSONB_OK) return ret;
+    }
+    else
+        BUFFER_COPY(b, str, len, pos, buf, bufsize);
+    if (truncated)
+        BUFFER_COPY(b, JSONB_TRUNCATE_MARKER,
+                    sizeof(JSONB_TRUNCATE_MARKER) - 1, pos, buf, bufsize);
     BUFFER_COPY_CHAR(b, '"', pos, buf, bufsize);
     STACK_HEAD(b, next_state);
-    b->pos += pos;
+    CHECK_COUNT(b);
+    b->next_field = 0;
+    BUFFER_COMMIT(b, pos, buf, bufsize);
     return code;
 }
 
+JSONB_API jsonbcode
+jsonb_string(
+    jsonb *b, char buf[], size_t bufsize, const char str[], size_t len)
+{
+    return _jsonb_string(b, buf, bufsize, str, len, 1);
+}
+
+JSONB_API jsonbcode
+jsonb_string_raw(
+    jsonb *b, char buf[], size_t bufsize, const char str[], size_t len)
+{
+    return _jsonb_string(b, buf, bufsize, str, len, 0);
+}
+
+#ifdef JSONB_THREADS
+/* a chunk of a string, escaping is done byte per byte so that a string can
+ *      be split anywhere */
+struct _jsonb_chunk {
+    const char *str;
+    size_t len;
+    /* where the chunk is escaped to, NULL while it is only measured */
+    char *dest;
+    size_t escaped;
+};
+
+static void *
+_jsonb_chunk_run(void *arg)
+{
+    struct _jsonb_chunk *chunk = arg;
+    if (chunk->dest)
+        jsonb_escape(chunk->dest, chunk->str, chunk->len);
+    else
+        chunk->escaped = jsonb_escaped_len(chunk->str, chunk->len);
+    return NULL;
+}
+
+/* run the first chunk on the calling thread and every other one on a thread
+ *      of its own, or on the calling thread if none can be created */
+static void
+_jsonb_chunks_run(struct _jsonb_chunk chunks[], int n)
+{
+    pthread_t threads[JSONB_THREADS_MAX];
+    int created[JSONB_THREADS_MAX];
+    int i;
+    for (i = 1; i < n; ++i) {
+        created[i] =
+            !pthread_create(threads + i, NULL, _jsonb_chunk_run, chunks + i);
+        if (!created[i]) _jsonb_chunk_run(chunks + i);
+    }
+    _jsonb_chunk_run(chunks);
+    for (i = 1; i < n; ++i)
+        if (created[i]) pthread_join(threads[i], NULL);
+}
+
+JSONB_API jsonbcode
+jsonb_string_threads(jsonb *b,
+                     char buf[],
+                     size_t bufsize,
+                     const char str[],
+                     size_t len,
+                     int nthreads)
+{
+    struct _jsonb_chunk chunks[JSONB_THREADS_MAX];
+    enum jsonbstate next_state;
+    size_t comma, room, total = 0;
+    char *p;
+    int i;
+    if (nthreads > JSONB_THREADS_MAX) nthreads = JSONB_THREADS_MAX;
+    if (len < JSONB_THREADS_MIN || nthreads < 2 || !FAST_PATH(b, buf))
+        return jsonb_string(b, buf, bufsize, str, len);
+    next_state = _jsonb_next_value(b, &comma);
+    room = b->pos < bufsize ? bufsize - b->pos : 0;
+    /* room for the string once escaped, without quotes and NUL */
+    room = room >= comma + 3 ? room - comma - 3 : 0;
+    if (next_state == JSONB_ERROR || len > room)
+        return jsonb_string(b, buf, bufsize, str, len);
+    for (i = 0; i < nthreads; ++i) {
+        chunks[i].str = str + len / nthreads * i;
+        chunks[i].len = i == nthreads - 1 ? len - len / nthreads * i
+                                          : len / nthreads;
+        chunks[i].dest = NULL;
+    }
+    _jsonb_chunks_run(chunks, nthreads);
+    for (i = 0; i < nthreads; ++i)
+        total += chunks[i].escaped;
+    /* reported by jsonb_string(), which writes as much as it can */
+    if (total > room) return jsonb_string(b, buf, bufsize, str, len);
+    buf[b->pos] = ',';
+    buf[b->pos + comma] = '"';
+    /* each chunk is placed by the sum of the lengths of the ones before it */
+    p = buf + b->pos + comma + 1;
+    for (i = 0; i < nthreads; ++i) {
+        chunks[i].dest = p;
+        p += chunks[i].escaped;
+    }
+    _jsonb_chunks_run(chunks, nthreads);
+    *p++ = '"';
+    *p = '\0';
+    b->pos = p - buf;
+    STACK_HEAD(b, next_state);
+    return next_state == JSONB_DONE ? JSONB_END : JSONB_OK;
+}
+#endif /* JSONB_THREADS */
+
 JSONB_API jsonbcode
 jsonb_number(jsonb *b, char buf[], size_t bufsize, double number)
 {
     char token[32];
-    long len = sprintf(token, "%.17G", number);
+    long len;
+    if (number == 0 && _jsonb_omit(b, buf, bufsize)) return JSONB_OK;
+    len = sprintf(token, "%.17G", number);
     if (len < 0) return JSONB_ERROR_INPUT;
-    return jsonb_token(b, buf, bufsize, token, len);
+    return _jsonb_token(b, buf, bufsize, token, len, JSONB_TYPE_NUMBER);
+}
+
+/* digits of 'n' preceded by a '-' if 'negative', without going through
+ *      sprintf() */
+static jsonbcode
+_jsonb_integer(
+    jsonb *b, char buf[], size_t bufsize, unsigned long n, int negative)
+{
+    char token[24], *p = token + sizeof(token);
+    if (!n && _jsonb_omit(b, buf, bufsize)) return JSONB_OK;
+    do
+        *--p = (char)('0' + n % 10);
+    while (n /= 10);
+    if (negative) *--p = '-';
+    return _jsonb_token(b, buf, bufsize, p, token + sizeof(token) - p,
+                        JSONB_TYPE_NUMBER);
+}
+
+JSONB_API jsonbcode
+jsonb_integer(jsonb *b, char buf[], size_t bufsize, long number)
+{
+    /* negated as unsigned, as LONG_MIN's magnitude doesn't fit a long */
+    if (number < 0)
+        return _jsonb_integer(b, buf, bufsize, -(unsigned long)number, 1);
+    return _jsonb_integer(b, buf, bufsize, (unsigned long)number, 0);
+}
+
+JSONB_API jsonbcode
+jsonb_unsigned(jsonb *b, char buf[], size_t bufsize, unsigned long number)
+{
+    return _jsonb_integer(b, buf, bufsize, number, 0);
+}
+
+JSONB_API jsonbcode
+jsonb_close_all(jsonb *b, char buf[], size_t bufsize)
+{
+    enum jsonbcode code = JSONB_END;
+    /* a value that is being skipped is dropped altogether */
+    b->skip = 0;
+    /* a JSON that is closed early can't be expected to be complete */
+    b->check = NULL;
+    if (b->top == b->stack)
+        return *b->top == JSONB_DONE ? JSONB_END : JSONB_ERROR_INPUT;
+    if (*b->top == JSONB_OBJECT_VALUE) {
+        code = jsonb_null(b, buf, bufsize);
+        if (code < 0) return code;
+    }
+    while (b->top != b->stack) {
+        switch (*b->top) {
+        case JSONB_OBJECT_KEY_OR_CLOSE:
+        case JSONB_OBJECT_NEXT_KEY_OR_CLOSE:
+            code = jsonb_object_pop(b, buf, bufsize);
+            break;
+        case JSONB_ARRAY_VALUE_OR_CLOSE:
+        case JSONB_ARRAY_NEXT_VALUE_OR_CLOSE:
+            code = jsonb_array_pop(b, buf, bufsize);
+            break;
+        default:
+            return JSONB_ERROR_INPUT;
+        }
+        if (code < 0) return code;
+    }
+    return code;
+}
+
+/* copy 'b' to measure the output of a call that is to be written whole or not
+ *      at all, without touching the builder, nor its schema check: 'check'
+ *      gets the copy's state of the open containers */
+static void
+_jsonb_measurer(jsonb *m, struct jsonb_check *check, const jsonb *b)
+{
+    size_t i;
+    *m = *b;
+    m->top = m->stack + (b->top - b->stack);
+    if (!b->check) return;
+    check->root = b->check->root;
+    check->member = b->check->member;
+    for (i = 0; i <= STACK_DEPTH(b); ++i)
+        check->levels[i] = b->check->levels[i];
+    m->check = check;
+}
+
+/* longest "%.17G" of a double, e.g. -1.2345678901234567E-308 */
+#define NUMBER_MAX 24
+
+/* take 'n' times 'scale' bytes plus 'extra' out of 'room', 0 if they don't
+ *      fit */
+static int
+_jsonb_take(size_t *room, size_t n, size_t scale, size_t extra)
+{
+    if (n > *room / scale) return 0;
+    n *= scale;
+    if (extra > *room - n) return 0;
+    *room -= n + extra;
+    return 1;
+}
+
+/* whether a table (along with a leading ',') surely fits 'room', going by an
+ *      upper bound that is much cheaper than measuring it */
+static int
+_jsonb_table_fits(const struct jsonb_column columns[],
+                  size_t ncols,
+                  size_t nrows,
+                  size_t room)
+{
+    size_t i, j;
+    if (!_jsonb_take(&room, 0, 1, sizeof(",[]") - 1)) return 0;
+    for (i = 0; i < nrows; ++i) {
+        if (!_jsonb_take(&room, 0, 1, sizeof(",{}") - 1)) return 0;
+        for (j = 0; j < ncols; ++j) {
+            const struct jsonb_column *col = columns + j;
+            const char *str;
+            size_t len = 0;
+            int fits;
+            if (!_jsonb_take(&room, col->keylen, 1, sizeof(",\"\":") - 1))
+                return 0;
+            switch (col->type) {
+            case JSONB_TYPE_NUMBER:
+                fits = _jsonb_take(&room, 0, 1, NUMBER_MAX);
+                break;
+            case JSONB_TYPE_BOOL:
+                fits = _jsonb_take(&room, 0, 1, sizeof("false") - 1);
+                break;
+            default:
+                if (!(str = ((const char *const *)col->data)[i])) {
+                    fits = _jsonb_take(&room, 0, 1, sizeof("null") - 1);
+                    break;
+                }
+                while (str[len])
+                    ++len;
+                fits = _jsonb_take(&room, len, 6, 2);
+            }
+            if (!fits) return 0;
+        }
+    }
+    return 1;
+}
+
+static jsonbcode
+_jsonb_table(jsonb *b,
+             char buf[],
+             size_t bufsize,
+             const struct jsonb_column columns[],
+             size_t ncols,
+             size_t nrows)
+{
+    enum jsonbcode code = jsonb_array(b, buf, bufsize);
+    size_t i, j;
+    if (code < 0) return code;
+    for (i = 0; i < nrows; ++i) {
+        if ((code = jsonb_object(b, buf, bufsize)) < 0) return code;
+        for (j = 0; j < ncols; ++j) {
+            const struct jsonb_column *col = columns + j;
+            code = jsonb_key_raw(b, buf, bufsize, col->key, col->keylen);
+            if (code < 0) return code;
+            switch (col->type) {
+            case JSONB_TYPE_NUMBER:
+                code = jsonb_number(b, buf, bufsize,
+                                    ((const double *)col->data)[i]);
+                break;
+            case JSONB_TYPE_BOOL:
+                code = jsonb_bool(b, buf, bufsize,
+                                  ((const int *)col->data)[i]);
+                break;
+            default: {
+                const char *str = ((const char *const *)col->data)[i];
+                size_t len = 0;
+                if (!str) {
+                    code = jsonb_null(b, buf, bufsize);
+                    break;
+                }
+                while (str[len])
+                    ++len;
+                code = jsonb_string(b, buf, bufsize, str, len);
+            } break;
+            }
+            if (code < 0) return code;
+        }
+        if ((code = jsonb_object_pop(b, buf, bufsize)) < 0) return code;
+    }
+    return jsonb_array_pop(b, buf, bufsize);
+}
+
+JSONB_API jsonbcode
+jsonb_table(jsonb *b,
+            char buf[],
+            size_t bufsize,
+            const struct jsonb_column columns[],
+            size_t ncols,
+            size_t nrows)
+{
+    size_t j;
+    int measure;
+    for (j = 0; j < ncols; ++j)
+        if (columns[j].type != JSONB_TYPE_NUMBER
+            && columns[j].type != JSONB_TYPE_BOOL
+            && columns[j].type != JSONB_TYPE_STRING)
+            return JSONB_ERROR_INPUT;
+    /* measured exactly only when the bound doesn't settle it, or when the
+     *      rows must be checked before any of them is written */
+    measure = buf && !(b->flags & JSONB_TRUNCATE)
+              && (b->pos + BUFFER_TAIL(b) > bufsize
+                  || !_jsonb_table_fits(columns, ncols, nrows,
+                                        bufsize - b->pos - BUFFER_TAIL(b)));
+    if (measure || b->check) {
+        struct jsonb_check check;
+        enum jsonbcode code;
+        jsonb m;
+        _jsonb_measurer(&m, &check, b);
+        code = _jsonb_table(&m, NULL, 0, columns, ncols, nrows);
+        if (code < 0) return code;
+        if (measure && m.pos + BUFFER_TAIL(&m) > bufsize)
+            return JSONB_ERROR_NOMEM;
+    }
+    return _jsonb_table(b, buf, bufsize, columns, ncols, nrows);
+}
+
+/* 'numbers' is set for number values, 'vals' and 'vlens' otherwise */
+static jsonbcode
+_jsonb_pairs(jsonb *b,
+             char buf[],
+             size_t bufsize,
+             const char *const keys[],
+             const size_t klens[],
+             const char *const vals[],
+             const size_t vlens[],
+             const double numbers[],
+             size_t n)
+{
+    enum jsonbcode code = jsonb_object(b, buf, bufsize);
+    size_t i;
+    if (code < 0) return code;
+    for (i = 0; i < n; ++i) {
+        if ((code = jsonb_key(b, buf, bufsize, keys[i], klens[i])) < 0)
+            return code;
+        if (numbers)
+            code = jsonb_number(b, buf, bufsize, numbers[i]);
+        else if (vals[i])
+            code = jsonb_string(b, buf, bufsize, vals[i], vlens[i]);
+        else
+            code = jsonb_null(b, buf, bufsize);
+        if (code < 0) return code;
+    }
+    return jsonb_object_pop(b, buf, bufsize);
+}
+
+/* whether an object from pairs (along with a leading ',') surely fits 'room',
+ *      as with _jsonb_table_fits() */
+static int
+_jsonb_pairs_fit(const size_t klens[],
+                 const char *const vals[],
+                 const size_t vlens[],
+                 const double numbers[],
+                 size_t n,
+                 size_t room)
+{
+    size_t i;
+    if (!_jsonb_take(&room, 0, 1, sizeof(",{}") - 1)) return 0;
+    for (i = 0; i < n; ++i) {
+        if (!_jsonb_take(&room, klens[i], 6, sizeof(",\"\":") - 1)) return 0;
+        if (numbers) {
+            if (!_jsonb_take(&room, 0, 1, NUMBER_MAX)) return 0;
+        }
+        else if (vals[i]) {
+            if (!_jsonb_take(&room, vlens[i], 6, 2)) return 0;
+        }
+        else if (!_jsonb_take(&room, 0, 1, sizeof("null") - 1))
+            return 0;
+    }
+    return 1;
+}
+
+static jsonbcode
+_jsonb_object_from(jsonb *b,
+                   char buf[],
+                   size_t bufsize,
+                   const char *const keys[],
+                   const size_t klens[],
+                   const char *const vals[],
+                   const size_t vlens[],
+                   const double numbers[],
+                   size_t n)
+{
+    /* as with jsonb_table() */
+    const int measure =
+        buf && !(b->flags & JSONB_TRUNCATE)
+        && (b->pos + BUFFER_TAIL(b) > bufsize
+            || !_jsonb_pairs_fit(klens, vals, vlens, numbers, n,
+                                 bufsize - b->pos - BUFFER_TAIL(b)));
+    if (measure || b->check) {
+        struct jsonb_check check;
+        enum jsonbcode code;
+        jsonb m;
+        _jsonb_measurer(&m, &check, b);
+        code = _jsonb_pairs(&m, NULL, 0, keys, klens, vals, vlens, numbers, n);
+        if (code < 0) return code;
+        if (measure && m.pos + BUFFER_TAIL(&m) > bufsize)
+            return JSONB_ERROR_NOMEM;
+    }
+    return _jsonb_pairs(b, buf, bufsize, keys, klens, vals, vlens, numbers,
+                        n);
+}
+
+JSONB_API jsonbcode
+jsonb_object_from_pairs(jsonb *b,
+                        char buf[],
+                        size_t bufsize,
+                        const char *const keys[],
+                        const size_t klens[],
+                        const char *const vals[],
+                        const size_t vlens[],
+                        size_t n)
+{
+    return _jsonb_object_from(b, buf, bufsize, keys, klens, vals, vlens, NULL,
+                              n);
+}
+
+JSONB_API jsonbcode
+jsonb_object_from_numbers(jsonb *b,
+                          char buf[],
+                          size_t bufsize,
+                          const char *const keys[],
+                          const size_t klens[],
+                          const double numbers[],
+                          size_t n)
+{
+    return _jsonb_object_from(b, buf, bufsize, keys, klens, NULL, NULL,
+                              numbers, n);
+}
+
+/* take a step of jsonb_run() on the fast path, 0 if it isn't allowed in the
+ *      current state, which is then left untouched */
+static int
+_jsonb_run_step(jsonb *b, char step)
+{
+    enum jsonbstate new_state;
+    size_t comma;
+    switch (step) {
+    case '{':
+    case '[':
+        new_state = _jsonb_next_value(b, &comma);
+        if (new_state == JSONB_ERROR) return 0;
+        STACK_HEAD(b, new_state);
+        STACK_PUSH(b, step == '{' ? JSONB_OBJECT_KEY_OR_CLOSE
+                                  : JSONB_ARRAY_VALUE_OR_CLOSE);
+        return 1;
+    case ':':
+        if (*b->top != JSONB_OBJECT_KEY_OR_CLOSE
+            && *b->top != JSONB_OBJECT_NEXT_KEY_OR_CLOSE)
+            return 0;
+        STACK_HEAD(b, JSONB_OBJECT_VALUE);
+        return 1;
+    case '}':
+        if (*b->top != JSONB_OBJECT_KEY_OR_CLOSE
+            && *b->top != JSONB_OBJECT_NEXT_KEY_OR_CLOSE)
+            return 0;
+        STACK_POP(b);
+        return 1;
+    case ']':
+        if (*b->top != JSONB_ARRAY_VALUE_OR_CLOSE
+            && *b->top != JSONB_ARRAY_NEXT_VALUE_OR_CLOSE)
+            return 0;
+        STACK_POP(b);
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* take the run's steps one by one, with the builder functions */
+static jsonbcode
+_jsonb_run(jsonb *b,
+           char buf[],
+           size_t bufsize,
+           const char run[],
+           size_t len,
+           const char steps[])
+{
+    enum jsonbcode code = JSONB_OK;
+    size_t i, p = 0;
+    for (i = 0; steps[i]; ++i) {
+        size_t end;
+        if (p < len && run[p] == ',') ++p;
+        switch (steps[i]) {
+        case '{': code = jsonb_object(b, buf, bufsize); break;
+        case '[': code = jsonb_array(b, buf, bufsize); break;
+        case '}': code = jsonb_object_pop(b, buf, bufsize); break;
+        case ']': code = jsonb_array_pop(b, buf, bufsize); break;
+        case ':':
+            end = p + 1;
+            while (end < len && run[end] != '"')
+                end += run[end] == '\\' ? 2 : 1;
+            if (p >= len || run[p] != '"' || end >= len) {
+                STACK_HEAD(b, JSONB_ERROR);
+                return JSONB_ERROR_INPUT;
+            }
+            code = jsonb_key_raw(b, buf, bufsize, run + p + 1, end - p - 1);
+            /* the ':' is skipped below */
+            p = end + 1;
+            break;
+        default:
+            STACK_HEAD(b, JSONB_ERROR);
+            return JSONB_ERROR_INPUT;
+        }
+        ++p;
+        if (code < 0) return code;
+    }
+    return code;
+}
+
+JSONB_API jsonbcode
+jsonb_run(jsonb *b,
+          char buf[],
+          size_t bufsize,
+          const char run[],
+          size_t len,
+          const char steps[])
+{
+    size_t i, n = strlen(steps);
+    int measure;
+    if (FAST_PATH(b, buf) && STACK_DEPTH(b) + n <= JSONB_MAX_DEPTH) {
+        size_t comma = 0;
+        if (*steps == ':')
+            comma = *b->top == JSONB_OBJECT_NEXT_KEY_OR_CLOSE;
+        else if (*steps == '{' || *steps == '[')
+            _jsonb_next_value(b, &comma);
+        if (len < bufsize && b->pos + comma < bufsize - len
+            && _jsonb_run_step(b, *steps)) {
+            for (i = 1; i < n; ++i)
+                if (!_jsonb_run_step(b, steps[i])) {
+                    /* the run's steps don't follow each other */
+                    STACK_HEAD(b, JSONB_ERROR);
+                    return JSONB_ERROR_INPUT;
+                }
+            FAST_COPY(b, buf, comma, run, len);
+            return b->top == b->stack ? JSONB_END : JSONB_OK;
+        }
+    }
+    /* as with jsonb_table(), the run is at most its leading comma longer
+     *      than its bytes */
+    measure = buf && !(b->flags & JSONB_TRUNCATE)
+              && (b->pos + BUFFER_TAIL(b) > bufsize
+                  || bufsize - b->pos - BUFFER_TAIL(b) <= len);
+    if (measure || b->check) {
+        struct jsonb_check check;
+        enum jsonbcode code;
+        jsonb m;
+        _jsonb_measurer(&m, &check, b);
+        code = _jsonb_run(&m, NULL, 0, run, len, steps);
+        if (code < 0) {
+            /* as if the run had been taken, minus its output */
+            if (*m.top == JSONB_ERROR) STACK_HEAD(b, JSONB_ERROR);
+            return code;
+        }
+        if (measure && m.pos + BUFFER_TAIL(&m) > bufsize)
+            return JSONB_ERROR_NOMEM;
+    }
+    return _jsonb_run(b, buf, bufsize, run, len, steps);
+}
+
+JSONB_API void
+jsonb_memo_init(jsonb_memo *memo,
+                struct jsonb_memo_slot slots[],
+                size_t nslots,
+                char arena[],
+                size_t arenasize)
+{
+    size_t i;
+    for (i = 0; i < nslots; ++i)
+        slots[i].len = 0;
+    memo->slots = slots;
+    memo->nslots = nslots;
+    memo->arena = arena;
+    memo->slot_size = arenasize / nslots;
+    memo->clock = 0;
+    memo->hits = memo->misses = memo->evictions = 0;
+}
+
+JSONB_API int
+jsonb_memo_lookup(jsonb_memo *memo,
+                  unsigned long hash,
+                  const char **value,
+                  size_t *len)
+{
+    size_t i;
+    for (i = 0; i < memo->nslots; ++i) {
+        struct jsonb_memo_slot *slot = memo->slots + i;
+        if (slot->len && slot->hash == hash) {
+            slot->used = ++memo->clock;
+            *value = memo->arena + i * memo->slot_size;
+            *len = slot->len;
+            ++memo->hits;
+            return 1;
+        }
+    }
+    ++memo->misses;
+    return 0;
+}
+
+JSONB_API int
+jsonb_memo_store(jsonb_memo *memo,
+                 unsigned long hash,
+                 const char value[],
+                 size_t len)
+{
+    struct jsonb_memo_slot *slot = memo->slots;
+    char *dest;
+    size_t i;
+    if (!len || len > memo->slot_size) return 0;
+    /* the slot of the same hash, else a free one, else the least recent */
+    for (i = 0; i < memo->nslots; ++i) {
+        struct jsonb_memo_slot *s = memo->slots + i;
+        if (s->len && s->hash == hash) {
+            slot = s;
+            break;
+        }
+        if (!slot->len) continue;
+        if (!s->len || s->used < slot->used) slot = s;
+    }
+    if (i == memo->nslots && slot->len) ++memo->evictions;
+    dest = memo->arena + (slot - memo->slots) * memo->slot_size;
+    for (i = 0; i < len; ++i)
+        dest[i] = value[i];
+    slot->hash = hash;
+    slot->len = len;
+    slot->used = ++memo->clock;
+    return 1;
+}
+
+JSONB_API void
+jsonb_keycache_init(jsonb_keycache *cache,
+                    struct jsonb_keycache_slot slots[],
+                    size_t nslots,
+                    char arena[],
+                    size_t arenasize)
+{
+    size_t i;
+    for (i = 0; i < nslots; ++i) {
+        slots[i].keylen = slots[i].len = 0;
+        slots[i].gen = 0;
+    }
+    cache->slots = slots;
+    cache->nslots = nslots;
+    cache->arena = arena;
+    cache->slot_size = arenasize / nslots;
+    cache->hits = cache->misses = 0;
+    cache->bytes = 0;
+}
+
+JSONB_API void
+jsonb_keycache_ref(jsonb_keycache *cache,
+                   struct jsonb_keyref *ref,
+                   const char key[],
+                   size_t len)
+{
+    const unsigned long hash = _jsonb_hash(key, len, 0, 0);
+    const size_t i = hash % cache->nslots;
+    struct jsonb_keycache_slot *slot = cache->slots + i;
+    char *dest = cache->arena + i * cache->slot_size;
+    size_t n;
+    ref->key = key;
+    ref->len = len;
+    ref->slot = (size_t)-1;
+    if (len && slot->hash == hash
+        && _jsonb_key_eq(dest, slot->keylen, key, len)) {
+        ++cache->hits;
+    }
+    else {
+        ++cache->misses;
+        n = jsonb_escaped_len(key, len);
+        /* escaping only ever grows a key, so a key of the same length is
+         *      copied as-is and needn't be stored twice */
+        if (n == len) n = 0;
+        if (!len || len + n > cache->slot_size) return;
+        cache->bytes -= slot->keylen + slot->len;
+        memcpy(dest, key, len);
+        if (n) jsonb_escape(dest + len, key, len);
+        slot->hash = hash;
+        slot->keylen = len;
+        slot->len = n;
+        ++slot->gen;
+        cache->bytes += len + n;
+    }
+    ref->slot = i;
+    ref->gen = slot->gen;
+}
+
+JSONB_API jsonbcode
+jsonb_key_ref(jsonb *b,
+              char buf[],
+              size_t bufsize,
+              jsonb_keycache *cache,
+              struct jsonb_keyref *ref)
+{
+    const struct jsonb_keycache_slot *slot;
+    if (ref->slot != (size_t)-1 && cache->slots[ref->slot].gen != ref->gen)
+        jsonb_keycache_ref(cache, ref, ref->key, ref->len);
+    if (ref->slot == (size_t)-1)
+        return jsonb_key(b, buf, bufsize, ref->key, ref->len);
+    slot = cache->slots + ref->slot;
+    /* projections and schemas match raw keys by their unescaped form */
+    if (!slot->len) return jsonb_key_raw(b, buf, bufsize, ref->key, ref->len);
+    return jsonb_key_raw(b, buf, bufsize,
+                         cache->arena + ref->slot * cache->slot_size
+                             + ref->len,
+                         slot->len);
+}
+
+JSONB_API void
+jsonb_stitch_init(jsonb_stitch *stitch,
+                  struct jsonb_child children[],
+                  size_t nchildren)
+{
+    size_t i;
+    for (i = 0; i < nchildren; ++i)
+        children[i].done = 0;
+    stitch->children = children;
+    stitch->nchildren = nchildren;
+    stitch->next = 0;
+}
+
+JSONB_API void
+jsonb_stitch_complete(jsonb_stitch *stitch,
+                      size_t i,
+                      const char json[],
+                      size_t len)
+{
+    stitch->children[i].json = json;
+    stitch->children[i].len = len;
+    stitch->children[i].done = 1;
+}
+
+JSONB_API jsonbcode
+jsonb_stitch_flush(jsonb *b,
+                   char buf[],
+                   size_t bufsize,
+                   jsonb_stitch *stitch)
+{
+    enum jsonbcode code = JSONB_OK;
+    while (stitch->next < stitch->nchildren) {
+        const struct jsonb_child *child = stitch->children + stitch->next;
+        if (!child->done) break;
+        /* the key is already in if its value has failed before */
+        if (child->key && *b->top != JSONB_OBJECT_VALUE) {
+            code = jsonb_key(b, buf, bufsize, child->key, child->keylen);
+            if (code < 0) return code;
+        }
+        code = jsonb_token(b, buf, bufsize, child->json, child->len);
+        if (code < 0) return code;
+        ++stitch->next;
+    }
+    return code;
+}
+
+/* call the builder function of 'op' */
+static jsonbcode
+_jsonb_apply(jsonb *b,
+             char buf[],
+             size_t bufsize,
+             enum jsonbop op,
+             const char str[],
+             size_t len,
+             double number)
+{
+    switch (op) {
+    case JSONB_OP_OBJECT: return jsonb_object(b, buf, bufsize);
+    case JSONB_OP_OBJECT_POP: return jsonb_object_pop(b, buf, bufsize);
+    case JSONB_OP_KEY: return jsonb_key(b, buf, bufsize, str, len);
+    case JSONB_OP_ARRAY: return jsonb_array(b, buf, bufsize);
+    case JSONB_OP_ARRAY_POP: return jsonb_array_pop(b, buf, bufsize);
+    case JSONB_OP_TOKEN: return jsonb_token(b, buf, bufsize, str, len);
+    case JSONB_OP_BOOL: return jsonb_bool(b, buf, bufsize, number != 0);
+    case JSONB_OP_NULL: return jsonb_null(b, buf, bufsize);
+    case JSONB_OP_STRING: return jsonb_string(b, buf, bufsize, str, len);
+    case JSONB_OP_NUMBER: return jsonb_number(b, buf, bufsize, number);
+    default: return JSONB_ERROR_INPUT;
+    }
+}
+
+JSONB_API void
+jsonb_tape_init(jsonb_tape *tape, char buf[], size_t size)
+{
+    tape->buf = buf;
+    tape->size = size;
+    tape->pos = 0;
+}
+
+JSONB_API jsonbcode
+jsonb_tape_record(jsonb_tape *tape,
+                  enum jsonbop op,
+                  const char str[],
+                  size_t len,
+                  double number)
+{
+    const char *src = NULL;
+    size_t n = 0, extra = 0, i;
+    char *dest;
+    /* the opcode is followed by its scalar, and then by its string */
+    switch (op) {
+    case JSONB_OP_KEY:
+    case JSONB_OP_TOKEN:
+    case JSONB_OP_STRING:
+        src = (const char *)&len, n = sizeof(len), extra = len;
+        break;
+    case JSONB_OP_BOOL:
+    case JSONB_OP_NUMBER:
+        src = (const char *)&number, n = sizeof(number);
+        break;
+    case JSONB_OP_OBJECT:
+    case JSONB_OP_OBJECT_POP:
+    case JSONB_OP_ARRAY:
+    case JSONB_OP_ARRAY_POP:
+    case JSONB_OP_NULL:
+        break;
+    default:
+        return JSONB_ERROR_INPUT;
+    }
+    if (tape->size - tape->pos < 1 + n
+        || tape->size - tape->pos - 1 - n < extra)
+        return JSONB_ERROR_NOMEM;
+    dest = tape->buf + tape->pos;
+    *dest++ = (char)op;
+    for (i = 0; i < n; ++i)
+        *dest++ = src[i];
+    for (i = 0; i < extra; ++i)
+        *dest++ = str[i];
+    tape->pos += 1 + n + extra;
+    return JSONB_OK;
+}
+
+JSONB_API jsonbcode
+jsonb_tape_replay(jsonb *b,
+                  char buf[],
+                  size_t bufsize,
+                  const jsonb_tape *tape,
+                  size_t *offset)
+{
+    enum jsonbcode code = JSONB_OK;
+    while (*offset < tape->pos) {
+        const char *p = tape->buf + *offset;
+        size_t avail = tape->pos - *offset - 1, len = 0, n = 0, i;
+        enum jsonbop op = (enum jsonbop)(unsigned char)*p++;
+        double number = 0;
+        char *dest = NULL;
+        switch (op) {
+        case JSONB_OP_KEY:
+        case JSONB_OP_TOKEN:
+        case JSONB_OP_STRING:
+            dest = (char *)&len, n = sizeof(len);
+            break;
+        case JSONB_OP_BOOL:
+        case JSONB_OP_NUMBER:
+            dest = (char *)&number, n = sizeof(number);
+            break;
+        default:
+            break;
+        }
+        if (avail < n) return JSONB_ERROR_INPUT;
+        for (i = 0; i < n; ++i)
+            dest[i] = *p++;
+        if (avail - n < len) return JSONB_ERROR_INPUT;
+        code = _jsonb_apply(b, buf, bufsize, op, p, len, number);
+        if (code < 0) return code;
+        *offset += 1 + n + len;
+        if (code == JSONB_END) break;
+    }
+    return code;
+}
+
+JSONB_API size_t
+jsonb_exec(jsonb *b,
+           char buf[],
+           size_t bufsize,
+           const struct jsonb_op ops[],
+           size_t n,
+           jsonbcode *code)
+{
+    jsonbcode last = JSONB_OK;
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        last = _jsonb_apply(b, buf, bufsize, ops[i].op, ops[i].str,
+                            ops[i].len, ops[i].number);
+        if (last < 0) break;
+    }
+    if (code) *code = last;
+    return i;
+}
+
+JSONB_API void
+jsonb_logger_init(jsonb_logger *logger,
+                  char buf[],
+                  size_t bufsize,
+                  void (*sink)(void *data, const char line[], size_t len),
+                  void *data)
+{
+    jsonb_init(&logger->b);
+    logger->buf = buf;
+    logger->bufsize = bufsize;
+    logger->level = JSONB_LOG_DEBUG;
+    logger->sample = 1;
+    logger->count = 0;
+    logger->record_level = JSONB_LOG_DEBUG;
+    logger->active = 0;
+    logger->sink = sink;
+    logger->data = data;
+}
+
+/* the record's budget, which keeps room for its newline */
+#define LOG_BUFSIZE(logger) ((logger)->bufsize ? (logger)->bufsize - 1 : 0)
+
+JSONB_API int
+jsonb_log_begin(jsonb_logger *logger, enum jsonblevel level)
+{
+    static const char *const names[] = { "debug", "info", "warn", "error" };
+    const char *name = (unsigned)level <= JSONB_LOG_ERROR ? names[level] : "";
+    size_t len;
+    if (logger->count++ % (logger->sample > 1 ? logger->sample : 1)) return 0;
+    for (len = 0; name[len]; ++len)
+        continue;
+    jsonb_init(&logger->b);
+    logger->b.flags |= JSONB_TRUNCATE | JSONB_UNTERMINATED;
+    jsonb_object(&logger->b, logger->buf, LOG_BUFSIZE(logger));
+    jsonb_key_raw(&logger->b, logger->buf, LOG_BUFSIZE(logger), "level", 5);
+    jsonb_string(&logger->b, logger->buf, LOG_BUFSIZE(logger), name, len);
+    return 1;
+}
+
+JSONB_API void
+jsonb_log_string(jsonb_logger *logger,
+                 const char key[],
+                 size_t klen,
+                 const char str[],
+                 size_t len)
+{
+    jsonb_key_raw(&logger->b, logger->buf, LOG_BUFSIZE(logger), key, klen);
+    jsonb_string(&logger->b, logger->buf, LOG_BUFSIZE(logger), str, len);
+}
+
+JSONB_API void
+jsonb_log_number(jsonb_logger *logger,
+                 const char key[],
+                 size_t klen,
+                 double number)
+{
+    jsonb_key_raw(&logger->b, logger->buf, LOG_BUFSIZE(logger), key, klen);
+    jsonb_number(&logger->b, logger->buf, LOG_BUFSIZE(logger), number);
+}
+
+JSONB_API void
+jsonb_log_bool(jsonb_logger *logger,
+               const char key[],
+               size_t klen,
+               int boolean)
+{
+    jsonb_key_raw(&logger->b, logger->buf, LOG_BUFSIZE(logger), key, klen);
+    jsonb_bool(&logger->b, logger->buf, LOG_BUFSIZE(logger), boolean);
+}
+
+JSONB_API void
+jsonb_log_end(jsonb_logger *logger)
+{
+    jsonb *b = &logger->b;
+    logger->active = 0;
+    /* a buffer too small to even open the record drops it */
+    if (jsonb_close_all(b, logger->buf, LOG_BUFSIZE(logger)) != JSONB_END)
+        return;
+    logger->buf[b->pos] = '\n';
+    logger->sink(logger->data, logger->buf, b->pos + 1);
+}
+
+/* store 'n' bytes of 'value' in little-endian order */
+static void
+_jsonb_save_le(unsigned char *p, size_t value, int n)
+{
+    int i;
+    for (i = 0; i < n; ++i, value >>= 8)
+        p[i] = value & 0xFF;
+}
+
+/* returns 0 if the value doesn't fit a size_t */
+static int
+_jsonb_load_le(const unsigned char *p, size_t *value, int n)
+{
+    size_t v = 0;
+    int i;
+    for (i = n - 1; i >= 0; --i) {
+        if (v > ((size_t)-1) >> 8) return 0;
+        v = (v << 8) | p[i];
+    }
+    *value = v;
+    return 1;
+}
+
+/* bits of a saved level, next to its state */
+#define SAVE_FIELD_LEVEL 0x10
+#define SAVE_OMIT_FIRST  0x20
+
+JSONB_API size_t
+jsonb_save(const jsonb *b, char buf[], size_t bufsize)
+{
+    unsigned char *p = (unsigned char *)buf;
+    size_t depth = STACK_DEPTH(b), i;
+    const int omit = (b->flags & JSONB_OMITEMPTY) != 0;
+    if (b->check || JSONB_SAVE_SIZE(depth) > bufsize) return 0;
+    p[0] = JSONB_SAVE_VERSION;
+    _jsonb_save_le(p + 1, b->flags, 4);
+    _jsonb_save_le(p + 5, depth, 4);
+    _jsonb_save_le(p + 9, b->pos, 8);
+    _jsonb_save_le(p + 17, b->pending, 8);
+    _jsonb_save_le(p + 25, b->resume_src, 8);
+    _jsonb_save_le(p + 33, b->resume_pos, 8);
+    _jsonb_save_le(p + 41, b->reserve, 8);
+    _jsonb_save_le(p + 49, b->field, 8);
+    _jsonb_save_le(p + 57, b->next_field, 8);
+    _jsonb_save_le(p + 65, b->skip, 8);
+    /* marks are saved plus one, so that (size_t)-1 is 0 on any platform */
+    _jsonb_save_le(p + 73, b->omit_mark + 1, 8);
+    p[81] = b->omit_first != 0;
+    p += JSONB_SAVE_HEADER;
+    /* the top is the only reference to the stack, levels above the root
+     *      have their bits written by their push (if in use) */
+    for (i = 0; i <= depth; ++i) {
+        p[i] = b->stack[i] & 0xF;
+        if (!i) continue;
+        if (b->fields && (b->field_levels[i / 8] >> i % 8 & 1))
+            p[i] |= SAVE_FIELD_LEVEL;
+        if (omit && (b->omit_firsts[i / 8] >> i % 8 & 1))
+            p[i] |= SAVE_OMIT_FIRST;
+        _jsonb_save_le(p + depth + 1 + 8 * (i - 1),
+                       omit ? b->omit_marks[i] + 1 : 0, 8);
+    }
+    return JSONB_SAVE_SIZE(depth);
+}
+
+JSONB_API jsonbcode
+jsonb_load(jsonb *b, const char buf[], size_t bufsize)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    size_t flags, depth, pos, pending, resume_src, resume_pos, reserve, field,
+        next_field, skip, omit_mark, mark, i;
+    int omit_first;
+    if (bufsize < JSONB_SAVE_HEADER || p[0] != JSONB_SAVE_VERSION
+        || p[81] > 1)
+        return JSONB_ERROR_INPUT;
+    if (!_jsonb_load_le(p + 1, &flags, 4) || !_jsonb_load_le(p + 5, &depth, 4)
+        || !_jsonb_load_le(p + 9, &pos, 8)
+        || !_jsonb_load_le(p + 17, &pending, 8)
+        || !_jsonb_load_le(p + 25, &resume_src, 8)
+        || !_jsonb_load_le(p + 33, &resume_pos, 8)
+        || !_jsonb_load_le(p + 41, &reserve, 8)
+        || !_jsonb_load_le(p + 49, &field, 8)
+        || !_jsonb_load_le(p + 57, &next_field, 8)
+        || !_jsonb_load_le(p + 65, &skip, 8)
+        || !_jsonb_load_le(p + 73, &omit_mark, 8))
+        return JSONB_ERROR_INPUT;
+    if (depth > JSONB_MAX_DEPTH) return JSONB_ERROR_STACK;
+    if (bufsize < JSONB_SAVE_SIZE(depth)) return JSONB_ERROR_INPUT;
+    omit_first = p[81];
+    p += JSONB_SAVE_HEADER;
+    /* validate everything before the builder is touched */
+    for (i = 0; i <= depth; ++i)
+        if ((p[i] & 0xF) > JSONB_DONE
+            || p[i] & ~(i ? 0xF | SAVE_FIELD_LEVEL | SAVE_OMIT_FIRST : 0xF)
+            || (i && !_jsonb_load_le(p + depth + 1 + 8 * (i - 1), &mark, 8)))
+            return JSONB_ERROR_INPUT;
+    for (i = 0; i <= depth; ++i) {
+        b->stack[i] = (enum jsonbstate)(p[i] & 0xF);
+        if (i % 8 == 0) b->field_levels[i / 8] = b->omit_firsts[i / 8] = 0;
+        if (p[i] & SAVE_FIELD_LEVEL) b->field_levels[i / 8] |= 1u << i % 8;
+        if (p[i] & SAVE_OMIT_FIRST) b->omit_firsts[i / 8] |= 1u << i % 8;
+        mark = 0;
+        if (i) _jsonb_load_le(p + depth + 1 + 8 * (i - 1), &mark, 8);
+        /* back from plus one, 0 being (size_t)-1 */
+        b->omit_marks[i] = mark - 1;
+    }
+    b->top = b->stack + depth;
+    b->pos = pos;
+    b->flags = (unsigned)flags;
+    b->pending = pending;
+    b->resume_src = resume_src;
+    b->resume_pos = resume_pos;
+    b->reserve = reserve;
+    b->field = field;
+    b->next_field = next_field;
+    b->skip = skip;
+    b->omit_mark = omit_mark - 1;
+    b->omit_first = omit_first;
+    b->fields = NULL;
+    b->check = NULL;
+    return JSONB_OK;
 }
 #endif /* JSONB_HEADER */
 
@@ -0,0 +1,483 @@
+/*
+ * C++20 front-end for json-build.h, requires C++20 coroutines.
+ *
+ * The same rules of json-build.h apply: include it in one translation unit
+ * for the implementation, and define JSONB_HEADER in the other ones.
+ */
+#ifndef JSON_BUILD_HPP
+#define JSON_BUILD_HPP
+
+#include <array>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+
+#include "json-build.h"
+
+namespace json_build {
+
+/** @brief Builder error that stopped a generator, see generator::next() */
+class error : public std::runtime_error {
+  public:
+    explicit error(jsonbcode code)
+        : std::runtime_error(code == JSONB_ERROR_STACK
+                                 ? "json_build: JSONB_MAX_DEPTH exceeded"
+                                 : "json_build: invalid JSON input"),
+          code(code)
+    {
+    }
+
+    /** @brief The @ref jsonbcode returned by the failed operation */
+    jsonbcode code;
+};
+
+/**
+ * @brief Pull-based JSON serializer
+ *
+ * The document is produced by a coroutine that `co_await`s json-build
+ * operations (see json_build::object() and friends). Nothing is serialized
+ * until the caller pulls the next bytes with generator::next(), and the
+ * coroutine is suspended whenever the caller's window is full, so memory use
+ * is bounded by the window size no matter how large the document is.
+ *
+ * @code
+ * json_build::generator render(const std::vector<int> &v)
+ * {
+ *     co_await json_build::array();
+ *     for (int n : v)
+ *         co_await json_build::number(n);
+ *     co_await json_build::array_pop();
+ * }
+ *
+ * json_build::generator gen = render(v);
+ * while (!gen.done())
+ *     send(fd, gen.next(window)); // e.g. once the socket is writable
+ * @endcode
+ */
+class generator {
+  public:
+    struct promise_type {
+        /** builder in @ref JSONB_NONBLOCK mode */
+        jsonb b;
+        /** window given by the last generator::next() call */
+        std::span<char> window;
+        /** operation suspended for lack of space, retried on next pull */
+        void *pending = nullptr;
+        jsonbcode (*retry)(void *op, promise_type &p) = nullptr;
+        /** first error returned by an operation, the coroutine is never
+         *      resumed past it */
+        jsonbcode failed = JSONB_OK;
+
+        promise_type()
+        {
+            jsonb_init(&b);
+            b.flags |= JSONB_NONBLOCK | JSONB_UNTERMINATED;
+        }
+        generator get_return_object()
+        {
+            return generator(
+                std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() { throw; }
+    };
+
+    generator(generator &&other) noexcept : h(other.h) { other.h = {}; }
+    generator(const generator &) = delete;
+    generator &operator=(const generator &) = delete;
+    ~generator()
+    {
+        if (h) h.destroy();
+    }
+
+    /**
+     * @brief Serialize the next bytes of the document
+     *
+     * @param window where the bytes should be written to, throws
+     *      std::invalid_argument if empty as nothing could ever be pulled
+     * @return the written part of `window`, which is smaller than `window`
+     *      only once the document is complete
+     * @throw json_build::error once an operation has failed (e.g. a key
+     *      outside of an object), by this pull or an earlier one, as the
+     *      output can't be valid JSON anymore
+     */
+    std::span<char> next(std::span<char> window)
+    {
+        if (window.empty())
+            throw std::invalid_argument("json_build: empty window");
+        promise_type &p = h.promise();
+        if (p.failed) throw error(p.failed);
+        p.window = window;
+        jsonb_reset(&p.b);
+        if (p.pending) {
+            jsonbcode code = p.retry(p.pending, p);
+            if (code == JSONB_ERROR_WOULDBLOCK) return window.first(p.b.pos);
+            p.pending = nullptr;
+            if (code < 0) throw error(p.failed = code);
+        }
+        if (!h.done()) h.resume();
+        if (p.failed) throw error(p.failed);
+        return window.first(p.b.pos);
+    }
+
+    /** @brief Whether the whole document has been pulled */
+    bool done() const { return h.done() && !h.promise().pending; }
+
+  private:
+    explicit generator(std::coroutine_handle<promise_type> handle) : h(handle)
+    {
+    }
+
+    std::coroutine_handle<promise_type> h;
+};
+
+/**
+ * @brief Awaitable json-build operation, suspends the generator while the
+ *      caller's window is full
+ *
+ * `co_await` evaluates to the operation's @ref jsonbcode, @ref JSONB_OK or
+ * @ref JSONB_END: the generator is stopped at the first error instead, and
+ * generator::next() throws it
+ */
+template <class F> class operation {
+  public:
+    explicit operation(F f) : f(f) {}
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<generator::promise_type> h)
+    {
+        generator::promise_type &p = h.promise();
+        switch (call(this, p)) {
+        case JSONB_ERROR_WOULDBLOCK:
+            p.pending = this;
+            p.retry = &call;
+            return true;
+        case JSONB_OK:
+        case JSONB_END:
+            return false;
+        default:
+            /* stays suspended for good */
+            p.failed = code;
+            return true;
+        }
+    }
+    jsonbcode await_resume() const noexcept { return code; }
+
+  private:
+    static jsonbcode call(void *op, generator::promise_type &p)
+    {
+        operation *self = static_cast<operation *>(op);
+        return self->code =
+                   self->f(&p.b, p.window.data(), p.window.size());
+    }
+
+    F f;
+    jsonbcode code = JSONB_OK;
+};
+
+/** @brief Awaitable jsonb_object() */
+inline auto
+object()
+{
+    return operation([](jsonb *b, char *buf, size_t size) {
+        return jsonb_object(b, buf, size);
+    });
+}
+
+/** @brief Awaitable jsonb_object_pop() */
+inline auto
+object_pop()
+{
+    return operation([](jsonb *b, char *buf, size_t size) {
+        return jsonb_object_pop(b, buf, size);
+    });
+}
+
+/** @brief Awaitable jsonb_key() */
+inline auto
+key(std::string_view key)
+{
+    return operation([key](jsonb *b, char *buf, size_t size) {
+        return jsonb_key(b, buf, size, key.data(), key.size());
+    });
+}
+
+/** @brief Awaitable jsonb_array() */
+inline auto
+array()
+{
+    return operation([](jsonb *b, char *buf, size_t size) {
+        return jsonb_array(b, buf, size);
+    });
+}
+
+/** @brief Awaitable jsonb_array_pop() */
+inline auto
+array_pop()
+{
+    return operation([](jsonb *b, char *buf, size_t size) {
+        return jsonb_array_pop(b, buf, size);
+    });
+}
+
+/** @brief Awaitable jsonb_token() */
+inline auto
+token(std::string_view token)
+{
+    return operation([token](jsonb *b, char *buf, size_t size) {
+        return jsonb_token(b, buf, size, token.data(), token.size());
+    });
+}
+
+/** @brief Awaitable jsonb_bool() */
+inline auto
+boolean(bool boolean)
+{
+    return operation([boolean](jsonb *b, char *buf, size_t size) {
+        return jsonb_bool(b, buf, size, boolean);
+    });
+}
+
+/** @brief Awaitable jsonb_null() */
+inline auto
+null()
+{
+    return operation([](jsonb *b, char *buf, size_t size) {
+        return jsonb_null(b, buf, size);
+    });
+}
+
+/** @brief Awaitable jsonb_string() */
+inline auto
+string(std::string_view str)
+{
+    return operation([str](jsonb *b, char *buf, size_t size) {
+        return jsonb_string(b, buf, size, str.data(), str.size());
+    });
+}
+
+/** @brief Awaitable jsonb_number() */
+inline auto
+number(double number)
+{
+    return operation([number](jsonb *b, char *buf, size_t size) {
+        return jsonb_number(b, buf, size, number);
+    });
+}
+
+/**
+ * @brief Builder that follows the rules of json-build.h in constant
+ *      expressions, see json_build::render()
+ *
+ * Input that json-build would reject throws std::logic_error, which makes
+ * it a compile error during constant evaluation. Given no output, the
+ * builder only measures the output length (see size()).
+ */
+class static_builder {
+  public:
+    constexpr explicit static_builder(char *out = nullptr) : out(out) {}
+
+    constexpr void object()
+    {
+        value();
+        put('{');
+        push(JSONB_OBJECT_KEY_OR_CLOSE);
+    }
+    constexpr void object_pop()
+    {
+        if (state() != JSONB_OBJECT_KEY_OR_CLOSE
+            && state() != JSONB_OBJECT_NEXT_KEY_OR_CLOSE)
+            throw std::logic_error("json_build: no object to pop");
+        put('}');
+        --depth;
+    }
+    constexpr void key(std::string_view key)
+    {
+        switch (state()) {
+        case JSONB_OBJECT_NEXT_KEY_OR_CLOSE:
+            put(',');
+            [[fallthrough]];
+        case JSONB_OBJECT_KEY_OR_CLOSE:
+            put('"');
+            escape(key);
+            put('"');
+            put(':');
+            stack[depth] = JSONB_OBJECT_VALUE;
+            break;
+        default:
+            throw std::logic_error("json_build: unexpected key");
+        }
+    }
+    constexpr void array()
+    {
+        value();
+        put('[');
+        push(JSONB_ARRAY_VALUE_OR_CLOSE);
+    }
+    constexpr void array_pop()
+    {
+        if (state() != JSONB_ARRAY_VALUE_OR_CLOSE
+            && state() != JSONB_ARRAY_NEXT_VALUE_OR_CLOSE)
+            throw std::logic_error("json_build: no array to pop");
+        put(']');
+        --depth;
+    }
+    /** @brief Raw JSON token, e.g. a number that isn't an integer */
+    constexpr void token(std::string_view token)
+    {
+        value();
+        for (char c : token)
+            put(c);
+    }
+    constexpr void boolean(bool boolean) { token(boolean ? "true" : "false"); }
+    constexpr void null() { token("null"); }
+    constexpr void string(std::string_view str)
+    {
+        value();
+        put('"');
+        escape(str);
+        put('"');
+    }
+    constexpr void integer(long long number)
+    {
+        char digits[24] = {};
+        std::size_t n = 0;
+        /* negative remainders avoid overflowing on the smallest number */
+        bool negative = number < 0;
+        do {
+            long long digit = number % 10;
+            digits[n++] = static_cast<char>('0' + (negative ? -digit : digit));
+            number /= 10;
+        } while (number);
+        value();
+        if (negative) put('-');
+        while (n)
+            put(digits[--n]);
+    }
+
+    /** @brief Whether the JSON is complete */
+    constexpr bool done() const { return !depth && stack[0] == JSONB_DONE; }
+    /** @brief Amount of bytes written (or measured) */
+    constexpr std::size_t size() const { return pos; }
+
+  private:
+    constexpr enum jsonbstate state() const { return stack[depth]; }
+    constexpr void push(enum jsonbstate state)
+    {
+        if (depth >= JSONB_MAX_DEPTH)
+            throw std::logic_error("json_build: JSONB_MAX_DEPTH exceeded");
+        stack[++depth] = state;
+    }
+    /* same transitions as the builder functions of json-build.h */
+    constexpr void value()
+    {
+        switch (state()) {
+        case JSONB_ARRAY_OR_OBJECT_OR_VALUE:
+            stack[depth] = JSONB_DONE;
+            break;
+        case JSONB_ARRAY_NEXT_VALUE_OR_CLOSE:
+            put(',');
+            [[fallthrough]];
+        case JSONB_ARRAY_VALUE_OR_CLOSE:
+            stack[depth] = JSONB_ARRAY_NEXT_VALUE_OR_CLOSE;
+            break;
+        case JSONB_OBJECT_VALUE:
+            stack[depth] = JSONB_OBJECT_NEXT_KEY_OR_CLOSE;
+            break;
+        default:
+            throw std::logic_error("json_build: unexpected value");
+        }
+    }
+    constexpr void put(char c)
+    {
+        if (out) out[pos] = c;
+        ++pos;
+    }
+    constexpr void escape(std::string_view str)
+    {
+        constexpr char tohex[] = "0123456789abcdef";
+        for (char ch : str) {
+            unsigned char c = static_cast<unsigned char>(ch);
+            char seq = 0;
+            switch (c) {
+            case 0x22: seq = '"'; break;
+            case 0x5C: seq = '\\'; break;
+            case '\b': seq = 'b'; break;
+            case '\f': seq = 'f'; break;
+            case '\n': seq = 'n'; break;
+            case '\r': seq = 'r'; break;
+            case '\t': seq = 't'; break;
+            }
+            if (seq) {
+                put('\\');
+                put(seq);
+            }
+            else if (c > 0x1F)
+                put(ch);
+            else {
+                for (char x : { '\\', 'u', '0', '0' })
+                    put(x);
+                put(tohex[c >> 4]);
+                put(tohex[c & 0xF]);
+            }
+        }
+    }
+
+    enum jsonbstate stack[JSONB_MAX_DEPTH + 1] = { JSONB_INIT };
+    std::size_t depth = 0;
+    std::size_t pos = 0;
+    char *out;
+};
+
+/**
+ * @brief Render a static JSON document at compile time
+ *
+ * The document is written by `F`, a lambda taking a json_build::static_builder
+ * which is evaluated twice: once to measure the output, and once to write it
+ * into an array of that exact size. Invalid or incomplete documents are a
+ * compile error. Mix them with runtime output by splicing them with
+ * jsonb_token() (see json_build::view()).
+ *
+ * @code
+ * constexpr auto not_found = json_build::render<[](auto &b) {
+ *     b.object();
+ *     b.key("error");
+ *     b.string("not found");
+ *     b.object_pop();
+ * }>();
+ * @endcode
+ *
+ * @return `std::array<char, N>` holding the JSON, not NUL-terminated
+ */
+template <auto F>
+consteval auto
+render()
+{
+    constexpr std::size_t size = [] {
+        static_builder b;
+        F(b);
+        if (!b.done()) throw std::logic_error("json_build: incomplete JSON");
+        return b.size();
+    }();
+    std::array<char, size> out{};
+    static_builder b(out.data());
+    F(b);
+    return out;
+}
+
+/** @brief View of a document rendered by json_build::render() */
+template <std::size_t N>
+constexpr std::string_view
+view(const std::array<char, N> &json)
+{
+    return std::string_view(json.data(), N);
+}
+
+} // namespace json_build
+
+#endif /* JSON_BUILD_HPP */
@@ -0,0 +1,31 @@
+"""Time jsonb.dumps() against json.dumps(), run with 'make bench'."""
+
+import json
+import timeit
+
+import jsonb
+
+
+def stdlib(obj):
+    return json.dumps(obj, separators=(",", ":"), ensure_ascii=False,
+                      allow_nan=False)
+
+
+PAYLOADS = [
+    ("small", {"id": 1, "name": "x", "ok": True, "tags": ["a", "b"]}),
+    ("records", [{"id": i, "name": "name %d" % i, "score": i / 7,
+                  "tags": ["a", "b"], "parent": None} for i in range(1000)]),
+    ("strings", ["line %d \"quoted\"\n\tunicode é中" % i for i in range(1000)]),
+    ("numbers", [i * 1.5 for i in range(1000)] + list(range(1000))),
+    ("long string", "x" * (1 << 22) + "\n"),
+]
+
+for name, obj in PAYLOADS:
+    assert jsonb.dumps(obj) == stdlib(obj), name
+    times = []
+    for dumps in (jsonb.dumps, stdlib):
+        timer = timeit.Timer(lambda: dumps(obj))
+        number = timer.autorange()[0]
+        times.append(min(timer.repeat(5, number)) / number * 1e6)
+    print("%-12s jsonb %10.2f us   json %10.2f us   %5.2fx"
+          % (name, times[0], times[1], times[1] / times[0]))
@@ -0,0 +1,348 @@
+/*
+ * CPython extension that serializes Python objects with json-build.
+ *
+ * Usage:
+ * >>> import jsonb
+ * >>> jsonb.dumps({"a": [1, 2.5, None, True, "x"]})
+ * '{"a":[1,2.5,null,true,"x"]}'
+ *
+ * The output matches json.dumps(obj, separators=(",", ":"),
+ * ensure_ascii=False, allow_nan=False), int, float, bool and None keys being
+ * coerced to str the same way.
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <math.h>
+
+/* nesting is bounded by the interpreter's recursion limit first, as with the
+ * json module, the builder's stack only has to be deeper */
+#define JSONB_MAX_DEPTH 4096
+#define JSONB_STATIC
+#include "json-build.h"
+
+/* strings at least this long are escaped without holding the GIL */
+#define JSONB_NOGIL_MIN (1 << 20)
+
+struct dumper {
+    jsonb b;
+    /* growable output buffer, from the raw allocator so that it can grow
+     * while the GIL is released */
+    char *buf;
+    size_t size;
+    /* ids of the containers being walked, to detect circular references */
+    PyObject *markers;
+};
+
+static int
+grow(struct dumper *d, size_t min)
+{
+    size_t size = d->size;
+    char *buf;
+    while (size < min)
+        size *= 2;
+    if (size == d->size) size *= 2;
+    if (!(buf = PyMem_RawRealloc(d->buf, size))) return -1;
+    d->buf = buf;
+    d->size = size;
+    return 0;
+}
+
+static int
+raise_code(jsonbcode code)
+{
+    if (code == JSONB_ERROR_STACK)
+        PyErr_SetString(PyExc_RecursionError,
+                        "maximum JSON nesting depth exceeded");
+    else
+        PyErr_Format(PyExc_ValueError, "json-build error %d", (int)code);
+    return -1;
+}
+
+/* call a builder function, growing the buffer until its output fits */
+#define EMIT(d, call)                                                         \
+    do {                                                                      \
+        jsonbcode _code;                                                      \
+        while ((_code = (call)) == JSONB_ERROR_NOMEM)                         \
+            if (grow(d, 0)) return PyErr_NoMemory(), -1;                      \
+        if (_code < 0) return raise_code(_code);                              \
+    } while (0)
+
+static int
+dump_token(struct dumper *d, const char *token, size_t len)
+{
+    EMIT(d, jsonb_token(&d->b, d->buf, d->size, token, len));
+    return 0;
+}
+
+static int
+dump_string(struct dumper *d, PyObject *obj)
+{
+    jsonbcode code;
+    Py_ssize_t len;
+    const char *str = PyUnicode_AsUTF8AndSize(obj, &len);
+    int nomem = 0;
+    if (!str) return -1;
+    if (len < JSONB_NOGIL_MIN) {
+        EMIT(d, jsonb_string(&d->b, d->buf, d->size, str, len));
+        return 0;
+    }
+    /* room for the unescaped string, escapes are handled by retrying */
+    if (d->b.pos + len + 4 > d->size && grow(d, d->b.pos + len + 4))
+        return PyErr_NoMemory(), -1;
+    /* 'str' belongs to 'obj', keep it alive while other threads run */
+    Py_INCREF(obj);
+    Py_BEGIN_ALLOW_THREADS
+    while ((code = jsonb_string(&d->b, d->buf, d->size, str, len))
+           == JSONB_ERROR_NOMEM)
+        if (grow(d, 0)) {
+            nomem = 1;
+            break;
+        }
+    Py_END_ALLOW_THREADS
+    Py_DECREF(obj);
+    if (nomem) return PyErr_NoMemory(), -1;
+    if (code < 0) return raise_code(code);
+    return 0;
+}
+
+static int
+dump_long(struct dumper *d, PyObject *obj)
+{
+    char token[32];
+    PyObject *repr;
+    Py_ssize_t len;
+    const char *str;
+    int overflow, ret;
+    long long n = PyLong_AsLongLongAndOverflow(obj, &overflow);
+    if (n == -1 && PyErr_Occurred()) return -1;
+    if (!overflow) return dump_token(d, token, sprintf(token, "%lld", n));
+    /* int's own repr, even for subclasses (e.g. enum.IntEnum) */
+    if (!(repr = PyLong_Type.tp_repr(obj))) return -1;
+    if (!(str = PyUnicode_AsUTF8AndSize(repr, &len)))
+        ret = -1;
+    else
+        ret = dump_token(d, str, len);
+    Py_DECREF(repr);
+    return ret;
+}
+
+/* shortest repr that round-trips, as float.__repr__(), to be freed with
+ * PyMem_Free() */
+static char *
+float_repr(PyObject *obj)
+{
+    double n = PyFloat_AS_DOUBLE(obj);
+    if (!isfinite(n)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "Out of range float values are not JSON compliant");
+        return NULL;
+    }
+    return PyOS_double_to_string(n, 'r', 0, Py_DTSF_ADD_DOT_0, NULL);
+}
+
+static int
+dump_float(struct dumper *d, PyObject *obj)
+{
+    char *repr = float_repr(obj);
+    int ret;
+    if (!repr) return -1;
+    ret = dump_token(d, repr, strlen(repr));
+    PyMem_Free(repr);
+    return ret;
+}
+
+static int dump(struct dumper *d, PyObject *obj);
+
+/* mark a container as being walked, returns its id to be passed to leave()
+ * or NULL on error (ValueError for a circular reference) */
+static PyObject *
+enter(struct dumper *d, PyObject *obj, const char *where)
+{
+    PyObject *id = PyLong_FromVoidPtr(obj);
+    int seen;
+    if (!id) return NULL;
+    if ((seen = PySet_Contains(d->markers, id))) {
+        if (seen > 0)
+            PyErr_SetString(PyExc_ValueError, "Circular reference detected");
+    }
+    else if (!Py_EnterRecursiveCall(where)) {
+        if (!PySet_Add(d->markers, id)) return id;
+        Py_LeaveRecursiveCall();
+    }
+    Py_DECREF(id);
+    return NULL;
+}
+
+static int
+leave(struct dumper *d, PyObject *id)
+{
+    int ret = PySet_Discard(d->markers, id) < 0 ? -1 : 0;
+    Py_LeaveRecursiveCall();
+    Py_DECREF(id);
+    return ret;
+}
+
+/* the key as a new str, coerced from a scalar as json.dumps() does */
+static PyObject *
+key_str(PyObject *key)
+{
+    char *repr;
+    PyObject *str;
+    if (PyUnicode_Check(key)) {
+        Py_INCREF(key);
+        return key;
+    }
+    if (key == Py_True) return PyUnicode_FromString("true");
+    if (key == Py_False) return PyUnicode_FromString("false");
+    if (key == Py_None) return PyUnicode_FromString("null");
+    if (PyLong_Check(key)) return PyLong_Type.tp_repr(key);
+    if (PyFloat_Check(key)) {
+        if (!(repr = float_repr(key))) return NULL;
+        str = PyUnicode_FromString(repr);
+        PyMem_Free(repr);
+        return str;
+    }
+    PyErr_Format(PyExc_TypeError,
+                 "keys must be str, int, float, bool or None, not %s",
+                 Py_TYPE(key)->tp_name);
+    return NULL;
+}
+
+static int
+dump_key(struct dumper *d, PyObject *key)
+{
+    Py_ssize_t len;
+    const char *str = PyUnicode_AsUTF8AndSize(key, &len);
+    if (!str) return -1;
+    EMIT(d, jsonb_key(&d->b, d->buf, d->size, str, len));
+    return 0;
+}
+
+static int
+dump_member(struct dumper *d, PyObject *key, PyObject *value)
+{
+    PyObject *str = key_str(key);
+    int ret;
+    if (!str) return -1;
+    ret = dump_key(d, str);
+    Py_DECREF(str);
+    return ret ? -1 : dump(d, value);
+}
+
+/* containers and their items are owned while they are walked: the GIL may be
+ * released to write a long string, and other threads can drop or replace
+ * them in the meantime */
+
+static int
+dump_dict(struct dumper *d, PyObject *obj)
+{
+    PyObject *items, *id;
+    Py_ssize_t i;
+    int ret = 0;
+    EMIT(d, jsonb_object(&d->b, d->buf, d->size));
+    if (!(id = enter(d, obj, " while encoding a JSON object"))) return -1;
+    /* walk a snapshot of the items as the json module does, so that keys
+     * added or removed meanwhile aren't skipped or repeated */
+    if (!(items = PyDict_Items(obj))) ret = -1;
+    for (i = 0; !ret && i < PyList_GET_SIZE(items); ++i) {
+        PyObject *item = PyList_GET_ITEM(items, i);
+        ret = dump_member(d, PyTuple_GET_ITEM(item, 0),
+                          PyTuple_GET_ITEM(item, 1));
+    }
+    Py_XDECREF(items);
+    if (leave(d, id) || ret) return -1;
+    EMIT(d, jsonb_object_pop(&d->b, d->buf, d->size));
+    return 0;
+}
+
+static int
+dump_sequence(struct dumper *d, PyObject *obj)
+{
+    PyObject *id;
+    Py_ssize_t i;
+    int ret = 0;
+    EMIT(d, jsonb_array(&d->b, d->buf, d->size));
+    if (!(id = enter(d, obj, " while encoding a JSON array"))) return -1;
+    Py_INCREF(obj);
+    /* the size is read again, as a list may shrink meanwhile */
+    for (i = 0; !ret && i < PySequence_Fast_GET_SIZE(obj); ++i) {
+        PyObject *item = PySequence_Fast_GET_ITEM(obj, i);
+        Py_INCREF(item);
+        ret = dump(d, item);
+        Py_DECREF(item);
+    }
+    Py_DECREF(obj);
+    if (leave(d, id) || ret) return -1;
+    EMIT(d, jsonb_array_pop(&d->b, d->buf, d->size));
+    return 0;
+}
+
+static int
+dump(struct dumper *d, PyObject *obj)
+{
+    if (obj == Py_None) {
+        EMIT(d, jsonb_null(&d->b, d->buf, d->size));
+        return 0;
+    }
+    if (obj == Py_True || obj == Py_False) {
+        EMIT(d, jsonb_bool(&d->b, d->buf, d->size, obj == Py_True));
+        return 0;
+    }
+    if (PyUnicode_Check(obj)) return dump_string(d, obj);
+    if (PyLong_Check(obj)) return dump_long(d, obj);
+    if (PyFloat_Check(obj)) return dump_float(d, obj);
+    if (PyDict_Check(obj)) return dump_dict(d, obj);
+    if (PyList_Check(obj) || PyTuple_Check(obj)) return dump_sequence(d, obj);
+    PyErr_Format(PyExc_TypeError, "Object of type %s is not JSON serializable",
+                 Py_TYPE(obj)->tp_name);
+    return -1;
+}
+
+static PyObject *
+jsonb_dumps(PyObject *self, PyObject *obj)
+{
+    struct dumper *d;
+    PyObject *ret = NULL;
+    (void)self;
+    /* the builder's stack is too deep for the C stack of every thread */
+    if (!(d = PyMem_Malloc(sizeof *d))) return PyErr_NoMemory();
+    d->size = 4096;
+    if (!(d->buf = PyMem_RawMalloc(d->size))) {
+        PyMem_Free(d);
+        return PyErr_NoMemory();
+    }
+    if ((d->markers = PySet_New(NULL))) {
+        jsonb_init(&d->b);
+        if (!dump(d, obj))
+            ret = PyUnicode_DecodeUTF8(d->buf, d->b.pos, "surrogatepass");
+        Py_DECREF(d->markers);
+    }
+    PyMem_RawFree(d->buf);
+    PyMem_Free(d);
+    return ret;
+}
+
+static PyMethodDef jsonb_methods[] = {
+    { "dumps", jsonb_dumps, METH_O,
+      "dumps(obj, /)\n--\n\nSerialize obj to a compact JSON str." },
+    { NULL, NULL, 0, NULL },
+};
+
+static struct PyModuleDef jsonb_module = {
+    PyModuleDef_HEAD_INIT,
+    "jsonb",
+    "JSON serializer built on json-build.h",
+    -1,
+    jsonb_methods,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+};
+
+PyMODINIT_FUNC
+PyInit_jsonb(void)
+{
+    return PyModule_Create(&jsonb_module);
+}
@@ -0,0 +1,124 @@
+"""Check jsonb.dumps() against the json module, run with 'make check'."""
+
+import json
+import sys
+import threading
+
+import jsonb
+
+
+def expect(obj):
+    return json.dumps(obj, separators=(",", ":"), ensure_ascii=False,
+                      allow_nan=False)
+
+
+PAYLOADS = [
+    None,
+    True,
+    0,
+    -(2 ** 63),
+    2 ** 100,
+    0.1,
+    1e300,
+    -2.5e-7,
+    "",
+    "quote \" backslash \\ control \x01\n\t unicode é中\U0001f600",
+    [],
+    {},
+    (1, 2),
+    {"a": [1, {"b": None}], "c": {"d": [True, False, "x"]}},
+    ["x" * (1 << 21) + "\n"],
+    [{"id": i, "name": "n%d" % i, "score": i / 7} for i in range(1000)],
+    # scalar keys are coerced to str
+    {"s": 0, 7: 1, -2.5: 2, 1e300: 3, False: 4, None: 5, 2 ** 100: 6},
+]
+
+for obj in PAYLOADS:
+    assert jsonb.dumps(obj) == expect(obj), repr(obj)[:80]
+
+for obj, error in [({(1,): 2}, TypeError), ({float("inf"): 2}, ValueError),
+                   (float("nan"), ValueError), (object(), TypeError)]:
+    try:
+        jsonb.dumps(obj)
+    except error:
+        pass
+    else:
+        raise AssertionError(repr(obj))
+
+# deep nesting is fine up to the recursion limit, as with the json module
+deep = []
+for i in range(200):
+    deep = [i, {"k": deep}]
+assert jsonb.dumps(deep) == expect(deep), "deep nesting"
+for obj in [[]], {}:
+    for _ in range(sys.getrecursionlimit()):
+        obj = [obj]
+    try:
+        jsonb.dumps(obj)
+    except RecursionError:
+        pass
+    else:
+        raise AssertionError("nesting past the recursion limit")
+
+shared = [1]
+assert jsonb.dumps([shared, shared]) == "[[1],[1]]", "shared reference"
+loop = []
+loop.append({"a": loop})
+for obj in loop, loop[0]:
+    try:
+        jsonb.dumps(obj)
+    except ValueError as e:
+        assert str(e) == "Circular reference detected", e
+    else:
+        raise AssertionError("circular reference")
+
+
+def dumps_while(obj, mutate):
+    """jsonb.dumps(obj) while another thread runs mutate() as soon as it
+    gets the GIL, i.e. once a long string is written without it"""
+    go = threading.Event()
+
+    def run():
+        go.wait()
+        mutate()
+
+    thread = threading.Thread(target=run)
+    thread.start()
+    # keep the GIL away from 'run' until jsonb.dumps() releases it
+    interval = sys.getswitchinterval()
+    sys.setswitchinterval(10)
+    try:
+        go.set()
+        return jsonb.dumps(obj)
+    finally:
+        sys.setswitchinterval(interval)
+        thread.join()
+
+
+LONG = "x" * (1 << 25)
+
+
+# dropping the only reference to the list around the string must not free
+# what is still being walked
+def drop():
+    holder[0] = None
+    [[0] * 3 for _ in range(20000)]
+
+
+holder = [[LONG] + [[i] * 3 for i in range(2000)]]
+expected = expect(holder)
+assert dumps_while(holder, drop) == expected, "GIL released mid-walk"
+
+
+# keys added or removed meanwhile are neither skipped nor repeated
+def rekey():
+    members.clear()
+    members.update(("n%d" % i, i) for i in range(100))
+
+
+members = {"long": LONG, "a": 1, "b": 2}
+expected = expect(members)
+assert dumps_while(members, rekey) == expected, "dict changed mid-walk"
+
+print("%d payloads ok" % len(PAYLOADS))
+sys.exit(0)
@@ -0,0 +1,357 @@
+/*
+ * Microbenchmarks, each one timed over a fixed amount of work.
+ *
+ * Usage:
+ * $ make bench
+ * $ ./bench               # all of them
+ * $ ./bench small memo    # only those
+ * $ ./bench chunked 8     # jsonb_string_threads() with 8 threads (default 4)
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define JSONB_THREADS
+#include "json-build.h"
+/* generated by gen/jsonb-gen from gen/example.idl */
+#include "example.h"
+
+static char buf[1 << 26];
+
+static double
+now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void
+report(const char *name, const char *variant, double secs, double ops)
+{
+    printf("%-8s %-24s %10.1f ns/op\n", name, variant, secs * 1e9 / ops);
+}
+
+/* tiny tokens, where the per-call overhead dominates */
+static void
+bench_small(void)
+{
+    double t = now();
+    jsonb b;
+    int r, i;
+    for (r = 0; r < 200; ++r) {
+        jsonb_init(&b);
+        jsonb_array(&b, buf, sizeof(buf));
+        for (i = 0; i < 20000; ++i) {
+            jsonb_object(&b, buf, sizeof(buf));
+            jsonb_key(&b, buf, sizeof(buf), "name", 4);
+            jsonb_bool(&b, buf, sizeof(buf), 1);
+            jsonb_key(&b, buf, sizeof(buf), "v", 1);
+            jsonb_null(&b, buf, sizeof(buf));
+            jsonb_object_pop(&b, buf, sizeof(buf));
+        }
+        jsonb_array_pop(&b, buf, sizeof(buf));
+    }
+    report("small", "object of 2 members", now() - t, 200 * 20000.);
+}
+
+/* 4 KiB strings with a single escape */
+static void
+bench_strings(void)
+{
+    static char s[4096];
+    double t;
+    jsonb b;
+    int r, i;
+    memset(s, 'a', sizeof(s));
+    s[100] = '\n';
+    t = now();
+    for (r = 0; r < 200; ++r) {
+        jsonb_init(&b);
+        jsonb_array(&b, buf, sizeof(buf));
+        for (i = 0; i < 2000; ++i)
+            jsonb_string(&b, buf, sizeof(buf), s, sizeof(s));
+        jsonb_array_pop(&b, buf, sizeof(buf));
+    }
+    report("strings", "4 KiB string", now() - t, 200 * 2000.);
+}
+
+/* a subdocument of 16 members */
+static size_t
+render_meta(char dest[], size_t size)
+{
+    static const char *const keys[] = { "host", "region", "zone", "rack" };
+    jsonb b;
+    int i;
+    jsonb_init(&b);
+    jsonb_object(&b, dest, size);
+    for (i = 0; i < 16; ++i) {
+        char key[16];
+        sprintf(key, "%s%d", keys[i % 4], i);
+        jsonb_key(&b, dest, size, key, strlen(key));
+        if (i % 2)
+            jsonb_number(&b, dest, size, i * 1.5);
+        else
+            jsonb_string(&b, dest, size, "eu-west-1a", 10);
+    }
+    jsonb_object_pop(&b, dest, size);
+    return b.pos;
+}
+
+static void
+bench_memo(void)
+{
+    static char arena[4096], tmp[1024];
+    struct jsonb_memo_slot slots[4];
+    const char *value;
+    size_t len;
+    jsonb_memo memo;
+    double t;
+    jsonb b;
+    int i;
+    t = now();
+    for (i = 0; i < 1000000; ++i) {
+        len = render_meta(tmp, sizeof(tmp));
+        if (i % 1000 == 0) {
+            jsonb_init(&b);
+            jsonb_array(&b, buf, sizeof(buf));
+        }
+        jsonb_token(&b, buf, sizeof(buf), tmp, len);
+    }
+    report("memo", "rendered every time", now() - t, 1000000.);
+    jsonb_memo_init(&memo, slots, 4, arena, sizeof(arena));
+    t = now();
+    for (i = 0; i < 1000000; ++i) {
+        if (!jsonb_memo_lookup(&memo, 1, &value, &len)) {
+            len = render_meta(tmp, sizeof(tmp));
+            jsonb_memo_store(&memo, 1, tmp, len);
+            value = tmp;
+        }
+        if (i % 1000 == 0) {
+            jsonb_init(&b);
+            jsonb_array(&b, buf, sizeof(buf));
+        }
+        jsonb_token(&b, buf, sizeof(buf), value, len);
+    }
+    report("memo", "jsonb_memo hit", now() - t, 1000000.);
+}
+
+/* what shape_to_json() would be if written by hand */
+static jsonbcode
+shape_by_hand(jsonb *b, char buf[], size_t bufsize, const struct shape *v)
+{
+    size_t i;
+    jsonb_object(b, buf, bufsize);
+    jsonb_key(b, buf, bufsize, "name", 4);
+    jsonb_string(b, buf, bufsize, v->name, strlen(v->name));
+    jsonb_key(b, buf, bufsize, "vertices", 8);
+    jsonb_array(b, buf, bufsize);
+    for (i = 0; i < 3; ++i) {
+        jsonb_object(b, buf, bufsize);
+        jsonb_key(b, buf, bufsize, "x", 1);
+        jsonb_number(b, buf, bufsize, v->vertices[i].x);
+        jsonb_key(b, buf, bufsize, "y", 1);
+        jsonb_number(b, buf, bufsize, v->vertices[i].y);
+        jsonb_object_pop(b, buf, bufsize);
+    }
+    jsonb_array_pop(b, buf, bufsize);
+    jsonb_key(b, buf, bufsize, "is-closed", 9);
+    jsonb_bool(b, buf, bufsize, v->closed);
+    jsonb_key(b, buf, bufsize, "tags", 4);
+    jsonb_array(b, buf, bufsize);
+    for (i = 0; i < 2; ++i)
+        jsonb_number(b, buf, bufsize, v->tags[i]);
+    jsonb_array_pop(b, buf, bufsize);
+    jsonb_key(b, buf, bufsize, "\"note\"", 6);
+    jsonb_null(b, buf, bufsize);
+    return jsonb_object_pop(b, buf, bufsize);
+}
+
+static void
+bench_gen(void)
+{
+    struct shape s = { "triangle", { { 0, 0 }, { 1, 0 }, { 0, 1.5 } }, 1,
+                       { 3, 4 }, NULL };
+    double t;
+    jsonb b;
+    int i;
+    t = now();
+    for (i = 0; i < 1000000; ++i) {
+        jsonb_init(&b);
+        shape_by_hand(&b, buf, sizeof(buf), &s);
+    }
+    report("gen", "hand-written", now() - t, 1000000.);
+    t = now();
+    for (i = 0; i < 1000000; ++i) {
+        jsonb_init(&b);
+        shape_to_json(&b, buf, sizeof(buf), &s);
+    }
+    report("gen", "shape_to_json()", now() - t, 1000000.);
+}
+
+/* 1000 rows of 4 columns, written whole or not at all */
+static void
+bench_table(void)
+{
+    static double ts[1000];
+    static int up[1000];
+    static const char *host[1000], *path[1000];
+    struct jsonb_column columns[] = {
+        { "ts", 2, JSONB_TYPE_NUMBER, NULL },
+        { "up", 2, JSONB_TYPE_BOOL, NULL },
+        { "host", 4, JSONB_TYPE_STRING, NULL },
+        { "path", 4, JSONB_TYPE_STRING, NULL },
+    };
+    double t;
+    jsonb b;
+    int i;
+    for (i = 0; i < 1000; ++i) {
+        ts[i] = 1700000000 + i;
+        up[i] = i % 3 != 0;
+        host[i] = i % 7 ? "web-01.example.com" : NULL;
+        path[i] = "/var/log/\"app\".log";
+    }
+    columns[0].data = ts;
+    columns[1].data = up;
+    columns[2].data = host;
+    columns[3].data = path;
+    t = now();
+    for (i = 0; i < 1000; ++i) {
+        jsonb_init(&b);
+        jsonb_table(&b, buf, sizeof(buf), columns, 4, 1000);
+    }
+    report("table", "jsonb_table() row", now() - t, 1000 * 1000.);
+}
+
+/* an object of 16 labels */
+static void
+bench_pairs(void)
+{
+    static const char *const keys[16] = {
+        "job", "instance", "env",  "region", "zone", "az",  "host", "pod",
+        "ns",  "node",     "team", "svc",    "rack", "dc",  "os",   "arch"
+    };
+    static const char *vals[16];
+    size_t klens[16], vlens[16];
+    double t;
+    jsonb b;
+    int i;
+    for (i = 0; i < 16; ++i) {
+        klens[i] = strlen(keys[i]);
+        vals[i] = "prometheus-scrape";
+        vlens[i] = 17;
+    }
+    t = now();
+    for (i = 0; i < 1000000; ++i) {
+        if (i % 1000 == 0) {
+            jsonb_init(&b);
+            jsonb_array(&b, buf, sizeof(buf));
+        }
+        jsonb_object_from_pairs(&b, buf, sizeof(buf), keys, klens, vals,
+                                vlens, 16);
+    }
+    report("pairs", "jsonb_object_from_pairs()", now() - t, 1000000.);
+}
+
+/* a plain and an escaped key, as labels of metric samples */
+static void
+bench_keys(void)
+{
+    static const char plain[] = "instance", escaped[] = "le\"quantile\"";
+    struct jsonb_keycache_slot slots[64];
+    static char arena[64 * 32];
+    struct jsonb_keyref refs[2];
+    jsonb_keycache cache;
+    double t;
+    jsonb b;
+    int i, k;
+    for (k = 0; k < 2; ++k) {
+        jsonb_keycache_init(&cache, slots, 64, arena, sizeof(arena));
+        jsonb_keycache_ref(&cache, refs, plain, sizeof(plain) - 1);
+        jsonb_keycache_ref(&cache, refs + 1, escaped, sizeof(escaped) - 1);
+        t = now();
+        for (i = 0; i < 1000000; ++i) {
+            if (i % 1000 == 0) {
+                jsonb_init(&b);
+                jsonb_array(&b, buf, sizeof(buf));
+            }
+            jsonb_object(&b, buf, sizeof(buf));
+            if (k == 0) {
+                jsonb_key(&b, buf, sizeof(buf), plain, sizeof(plain) - 1);
+                jsonb_null(&b, buf, sizeof(buf));
+                jsonb_key(&b, buf, sizeof(buf), escaped, sizeof(escaped) - 1);
+            }
+            else {
+                jsonb_key_ref(&b, buf, sizeof(buf), &cache, refs);
+                jsonb_null(&b, buf, sizeof(buf));
+                jsonb_key_ref(&b, buf, sizeof(buf), &cache, refs + 1);
+            }
+            jsonb_null(&b, buf, sizeof(buf));
+            jsonb_object_pop(&b, buf, sizeof(buf));
+        }
+        report("keys", k == 0 ? "jsonb_key()" : "jsonb_key_ref()", now() - t,
+               1000000.);
+    }
+}
+
+static void
+bench_chunked(int nthreads)
+{
+    static char s[1 << 24];
+    size_t len, i;
+    for (i = 0; i < sizeof(s); ++i)
+        s[i] = i % 80 == 79 ? '\n' : 'a' + i % 26;
+    for (len = 1 << 14; len <= sizeof(s); len <<= 2) {
+        const int reps = (int)((1 << 28) / len);
+        char name[32];
+        double t;
+        jsonb b;
+        int r;
+        t = now();
+        for (r = 0; r < reps; ++r) {
+            jsonb_init(&b);
+            jsonb_string(&b, buf, sizeof(buf), s, len);
+        }
+        sprintf(name, "%lu KiB, jsonb_string()", (unsigned long)len >> 10);
+        report("chunked", name, now() - t, reps);
+        t = now();
+        for (r = 0; r < reps; ++r) {
+            jsonb_init(&b);
+            jsonb_string_threads(&b, buf, sizeof(buf), s, len, nthreads);
+        }
+        sprintf(name, "%lu KiB, %d threads", (unsigned long)len >> 10,
+                nthreads);
+        report("chunked", name, now() - t, reps);
+    }
+}
+
+static int
+wanted(int argc, char *argv[], const char *name)
+{
+    int i;
+    if (argc < 2) return 1;
+    for (i = 1; i < argc; ++i)
+        if (!strcmp(argv[i], name)) return 1;
+    return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int nthreads = 4, i;
+    for (i = 1; i < argc; ++i)
+        if (atoi(argv[i]) > 0 && atoi(argv[i]) <= 64) nthreads = atoi(argv[i]);
+    if (wanted(argc, argv, "small")) bench_small();
+    if (wanted(argc, argv, "strings")) bench_strings();
+    if (wanted(argc, argv, "memo")) bench_memo();
+    if (wanted(argc, argv, "gen")) bench_gen();
+    if (wanted(argc, argv, "table")) bench_table();
+    if (wanted(argc, argv, "pairs")) bench_pairs();
+    if (wanted(argc, argv, "keys")) bench_keys();
+    if (wanted(argc, argv, "chunked")) bench_chunked(nthreads);
+    return 0;
+}
@@ -1,9 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <limits.h>
 #include <stddef.h>
 
 #define JSONB_MAX_DEPTH 1028
+/* low enough for short strings to take the threaded path */
+#define JSONB_THREADS
+#define JSONB_THREADS_MIN 16
 #include "json-build.h"
 
 #include "greatest.h"
@@ -105,11 +109,1072 @@ check_valid_object(void)
     PASS();
 }
 
+TEST
+check_valid_measure(void)
+{
+    char buf[64];
+    size_t len;
+    jsonb b;
+
+    jsonb_init(&b);
+    ASSERT_EQ(JSONB_OK, jsonb_object(&b, NULL, 0));
+    ASSERT_EQ(JSONB_OK, jsonb_key(&b, NULL, 0, "msg", 3));
+    ASSERT_EQ(JSONB_OK, jsonb_string(&b, NULL, 0, "a\tb\1", 4));
+    ASSERT_EQ(JSONB_OK, jsonb_key(&b, NULL, 0, "n", 1));
+    ASSERT_EQ(JSONB_OK, jsonb_number(&b, NULL, 0, 42));
+    ASSERT_EQ(JSONB_END, jsonb_object_pop(&b, NULL, 0));
+    len = b.pos;
+
+    /* the measured length (plus NUL) is exactly enough */
+    jsonb_init(&b);
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, len + 1));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, len + 1, "msg", 3));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_string(&b, buf, len + 1, "a\tb\1", 4));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, len + 1, "n", 1));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_number(&b, buf, len + 1, 42));
+    ASSERT_EQm(buf, JSONB_END, jsonb_object_pop(&b, buf, len + 1));
+    ASSERT_EQ(len, b.pos);
+    ASSERT_STR_EQ("{\"msg\":\"a\\tb\\u0001\",\"n\":42}", buf);
+
+    PASS();
+}
+
+TEST
+check_valid_array_extend(void)
+{
+    char buf[64], *elem;
+    size_t tail, off[2], len[2];
+    jsonb b, eb;
+
+    jsonb_init(&b);
+    ASSERT_EQm(buf, JSONB_OK, jsonb_array(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_bool(&b, buf, sizeof(buf), 1));
+
+    /* workers reserve ',' + element, 'tail' stands for an atomic counter */
+    tail = b.pos;
+    len[0] = sizeof("{\"a\":1}") - 1;
+    off[0] = tail, tail += 1 + len[0];
+    len[1] = sizeof("\"x\"") - 1;
+    off[1] = tail, tail += 1 + len[1];
+
+    /* ... and may complete in any order */
+    jsonb_init(&eb);
+    eb.flags |= JSONB_UNTERMINATED;
+    buf[off[1]] = ',', elem = buf + off[1] + 1;
+    ASSERT_EQ(JSONB_END, jsonb_string(&eb, elem, len[1], "x", 1));
+    jsonb_init(&eb);
+    eb.flags |= JSONB_UNTERMINATED;
+    buf[off[0]] = ',', elem = buf + off[0] + 1;
+    ASSERT_EQ(JSONB_OK, jsonb_object(&eb, elem, len[0]));
+    ASSERT_EQ(JSONB_OK, jsonb_key(&eb, elem, len[0], "a", 1));
+    ASSERT_EQ(JSONB_OK, jsonb_number(&eb, elem, len[0], 1));
+    ASSERT_EQ(JSONB_END, jsonb_object_pop(&eb, elem, len[0]));
+
+    ASSERT_EQm(buf, JSONB_OK,
+               jsonb_array_extend(&b, buf, sizeof(buf), tail - b.pos));
+    ASSERT_EQm(buf, JSONB_END, jsonb_array_pop(&b, buf, sizeof(buf)));
+    ASSERT_STR_EQ("[true,{\"a\":1},\"x\"]", buf);
+
+    /* the first element's comma is blanked */
+    jsonb_init(&b);
+    ASSERT_EQm(buf, JSONB_OK, jsonb_array(&b, buf, sizeof(buf)));
+    memcpy(buf + b.pos, ",null", 5);
+    /* nothing is touched unless the elements fit */
+    ASSERT_EQm(buf, JSONB_ERROR_NOMEM, jsonb_array_extend(&b, buf, 6, 5));
+    ASSERT_EQ(1, b.pos);
+    ASSERT_MEM_EQ("[,null", buf, 6);
+    ASSERT_EQm(buf, JSONB_OK, jsonb_array_extend(&b, buf, sizeof(buf), 5));
+    ASSERT_EQm(buf, JSONB_END, jsonb_array_pop(&b, buf, sizeof(buf)));
+    ASSERT_STR_EQ("[ null]", buf);
+
+    PASS();
+}
+
+TEST
+check_valid_numbers(void)
+{
+    const double numbers[] = { 1, -2.5, 0.1, 1e300, 3 };
+    char buf[256], expect[256];
+    size_t off[3], i;
+    jsonb b;
+
+    jsonb_init(&b);
+    ASSERT_EQm(expect, JSONB_OK, jsonb_array(&b, expect, sizeof(expect)));
+    for (i = 0; i < 5; ++i)
+        ASSERT_EQm(expect, JSONB_OK,
+                   jsonb_number(&b, expect, sizeof(expect), numbers[i]));
+    ASSERT_EQm(expect, JSONB_END, jsonb_array_pop(&b, expect, sizeof(expect)));
+
+    /* measure two partitions, and write them in any order */
+    jsonb_init(&b);
+    ASSERT_EQm(buf, JSONB_OK, jsonb_array(&b, buf, sizeof(buf)));
+    off[0] = b.pos;
+    off[1] = off[0] + jsonb_numbers(NULL, numbers, 2);
+    off[2] = off[1] + jsonb_numbers(NULL, numbers + 2, 3);
+    ASSERT_EQ(off[2] - off[1], jsonb_numbers(buf + off[1], numbers + 2, 3));
+    ASSERT_EQ(off[1] - off[0], jsonb_numbers(buf + off[0], numbers, 2));
+    ASSERT_EQm(buf, JSONB_OK,
+               jsonb_array_extend(&b, buf, sizeof(buf), off[2] - off[0]));
+    ASSERT_EQm(buf, JSONB_END, jsonb_array_pop(&b, buf, sizeof(buf)));
+    /* the first element's comma is blanked */
+    ASSERT_EQ(' ', buf[1]);
+    buf[1] = '[';
+    ASSERT_STR_EQ(expect, buf + 1);
+
+    PASS();
+}
+
+TEST
+check_valid_stitch(void)
+{
+    struct jsonb_child children[3] = {
+        { "a", 1, NULL, 0, 0 },
+        { "b", 1, NULL, 0, 0 },
+        { "c", 1, NULL, 0, 0 },
+    };
+    jsonb_stitch stitch;
+    char buf[64];
+    jsonb b;
+
+    jsonb_init(&b);
+    jsonb_stitch_init(&stitch, children, 3);
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, sizeof(buf)));
+
+    /* children complete out of order, but are stitched in document order */
+    jsonb_stitch_complete(&stitch, 2, "[3]", 3);
+    ASSERT_EQm(buf, JSONB_OK,
+               jsonb_stitch_flush(&b, buf, sizeof(buf), &stitch));
+    ASSERT_STR_EQ("{", buf);
+    jsonb_stitch_complete(&stitch, 0, "{\"x\":1}", 7);
+    ASSERT_EQm(buf, JSONB_OK,
+               jsonb_stitch_flush(&b, buf, sizeof(buf), &stitch));
+    ASSERT_STR_EQ("{\"a\":{\"x\":1}", buf);
+    ASSERT_EQ(1, stitch.next);
+
+    /* a child that doesn't fit is stitched again by the next call */
+    jsonb_stitch_complete(&stitch, 1, "\"long value\"", 12);
+    ASSERT_EQm(buf, JSONB_ERROR_NOMEM,
+               jsonb_stitch_flush(&b, buf, 24, &stitch));
+    ASSERT_EQ(1, stitch.next);
+    ASSERT_EQm(buf, JSONB_OK,
+               jsonb_stitch_flush(&b, buf, sizeof(buf), &stitch));
+    ASSERT_EQ(3, stitch.next);
+    ASSERT_EQm(buf, JSONB_END, jsonb_object_pop(&b, buf, sizeof(buf)));
+    ASSERT_STR_EQ("{\"a\":{\"x\":1},\"b\":\"long value\",\"c\":[3]}", buf);
+
+    PASS();
+}
+
+TEST
+check_valid_table(void)
+{
+    static const struct jsonb_schema number = { JSONB_TYPE_NUMBER, NULL, 0,
+                                                NULL, 0, 0, NULL, 0, 0 };
+    static const struct jsonb_schema string = { JSONB_TYPE_STRING, NULL, 0,
+                                                NULL, 0, 0, NULL, 0, 0 };
+    static const struct jsonb_schema_member members[] = {
+        { "ts", 2, &number, 1 },
+        { "up", 2, NULL, 0 },
+        { "host", 4, &string, 0 },
+    };
+    static const struct jsonb_schema row = { JSONB_TYPE_OBJECT, members, 3,
+                                             NULL, 0, 0, NULL, 0, 0 };
+    static const struct jsonb_schema rows = { JSONB_TYPE_ARRAY, NULL, 0,
+                                              NULL, 0, 0, &row, 0, 0 };
+    const double ts[] = { 1, 2, 3 };
+    const int up[] = { 1, 0, 1 };
+    const char *const host[] = { "a", NULL, "c\"" };
+    struct jsonb_column columns[] = {
+        { "ts", 2, JSONB_TYPE_NUMBER, NULL },
+        { "up", 2, JSONB_TYPE_BOOL, NULL },
+        { "host", 4, JSONB_TYPE_STRING, NULL },
+    };
+    const char expect[] =
+        "{\"rows\":[{\"ts\":1,\"up\":true,\"host\":\"a\"},"
+        "{\"ts\":2,\"up\":false,\"host\":null},"
+        "{\"ts\":3,\"up\":true,\"host\":\"c\\\"\"}]}";
+    struct jsonb_check check;
+    char buf[512];
+    jsonbcode code;
+    size_t size;
+    jsonb b;
+
+    columns[0].data = ts;
+    columns[1].data = up;
+    columns[2].data = host;
+    jsonb_init(&b);
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "rows", 4));
+
+    /* nothing is written unless the whole table fits */
+    ASSERT_EQm(buf, JSONB_ERROR_NOMEM,
+               jsonb_table(&b, buf, sizeof(expect) - 2, columns, 3, 3));
+    ASSERT_STR_EQ("{\"rows\":", buf);
+    ASSERT_EQm(buf, JSONB_OK,
+               jsonb_table(&b, buf, sizeof(expect), columns, 3, 3));
+    ASSERT_EQm(buf, JSONB_END, jsonb_object_pop(&b, buf, sizeof(expect)));
+    ASSERT_STR_EQ(expect, buf);
+    /* whether it is settled by a bound or measured exactly */
+    for (size = sizeof("{\"rows\":"); size <= sizeof(buf); ++size) {
+        jsonb_init(&b);
+        jsonb_object(&b, buf, sizeof(buf));
+        jsonb_key(&b, buf, sizeof(buf), "rows", 4);
+        code = jsonb_table(&b, buf, size, columns, 3, 3);
+        if (size < sizeof(expect) - 1) {
+            ASSERT_EQm(buf, JSONB_ERROR_NOMEM, code);
+            ASSERT_STR_EQ("{\"rows\":", buf);
+        }
+        else
+            ASSERT_EQm(buf, JSONB_OK, code);
+    }
+
+    /* nor if a row fails the schema check, which is left untouched */
+    jsonb_check_init(&check, &rows);
+    jsonb_init(&b);
+    b.check = &check;
+    strcpy(buf, "#");
+    ASSERT_EQm(buf, JSONB_ERROR_SCHEMA,
+               jsonb_table(&b, buf, sizeof(buf), columns, 3, 3));
+    ASSERT_EQ(0, b.pos);
+    ASSERT_STR_EQ("#", buf);
+    ASSERT_EQm(buf, JSONB_END,
+               jsonb_table(&b, buf, sizeof(buf), columns, 3, 1));
+    ASSERT_STR_EQ("[{\"ts\":1,\"up\":true,\"host\":\"a\"}]", buf);
+
+    jsonb_init(&b);
+    columns[1].type = JSONB_TYPE_NULL;
+    ASSERT_EQ(JSONB_ERROR_INPUT,
+              jsonb_table(&b, buf, sizeof(buf), columns, 3, 3));
+    ASSERT_EQm(buf, JSONB_END,
+               jsonb_table(&b, buf, sizeof(buf), columns, 1, 0));
+    ASSERT_STR_EQ("[]", buf);
+
+    PASS();
+}
+
+TEST
+check_valid_object_from_pairs(void)
+{
+    static const struct jsonb_schema string = { JSONB_TYPE_STRING, NULL, 0,
+                                                NULL, 0, 0, NULL, 0, 0 };
+    static const struct jsonb_schema_member members[] = {
+        { "HOME", 4, NULL, 0 },
+        { "PATH", 4, NULL, 0 },
+        { "SHELL", 5, &string, 0 },
+    };
+    /* objects with a string SHELL, and with no SHELL at all */
+    static const struct jsonb_schema env = { JSONB_TYPE_OBJECT, members, 3,
+                                             NULL, 0, 0, NULL, 0, 0 };
+    static const struct jsonb_schema noshell = { JSONB_TYPE_OBJECT, members,
+                                                 2, NULL, 0, 0, NULL, 0, 0 };
+    const char *const keys[] = { "HOME", "PATH", "SHELL" };
+    const size_t klens[] = { 4, 4, 5 };
+    const char *const vals[] = { "/root", NULL, "/bin/\"sh\"" };
+    const size_t vlens[] = { 5, 0, 9 };
+    const double numbers[] = { 1, 0.5, -2 };
+    const char object[] =
+        "{\"HOME\":\"/root\",\"PATH\":null,\"SHELL\":\"/bin/\\\"sh\\\"\"}";
+    struct jsonb_check check;
+    char buf[256];
+    jsonbcode code;
+    size_t size;
+    jsonb b;
+
+    jsonb_init(&b);
+    ASSERT_EQm(buf, JSONB_OK, jsonb_array(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK,
+               jsonb_object_from_pairs(&b, buf, sizeof(buf), keys, klens,
+                                       vals, vlens, 3));
+    /* nothing is written unless the whole object fits */
+    ASSERT_EQm(buf, JSONB_ERROR_NOMEM,
+               jsonb_object_from_numbers(&b, buf, b.pos + 24, keys, klens,
+                                         numbers, 3));
+    ASSERT_EQm(buf, JSONB_OK,
+               jsonb_object_from_numbers(&b, buf, sizeof(buf), keys, klens,
+                                         numbers, 3));
+    ASSERT_EQm(buf, JSONB_OK,
+               jsonb_object_from_pairs(&b, buf, sizeof(buf), keys, klens,
+                                       vals, vlens, 0));
+    ASSERT_EQm(buf, JSONB_END, jsonb_array_pop(&b, buf, sizeof(buf)));
+    ASSERT_STR_EQ("[{\"HOME\":\"/root\",\"PATH\":null,"
+                  "\"SHELL\":\"/bin/\\\"sh\\\"\"},"
+                  "{\"HOME\":1,\"PATH\":0.5,\"SHELL\":-2},{}]",
+                  buf);
+    /* whether it is settled by a bound or measured exactly */
+    for (size = 2; size <= sizeof(buf); ++size) {
+        jsonb_init(&b);
+        jsonb_array(&b, buf, sizeof(buf));
+        code = jsonb_object_from_pairs(&b, buf, size, keys, klens, vals,
+                                       vlens, 3);
+        if (size < sizeof(object) + 1) {
+            ASSERT_EQm(buf, JSONB_ERROR_NOMEM, code);
+            ASSERT_STR_EQ("[", buf);
+        }
+        else
+            ASSERT_EQm(buf, JSONB_OK, code);
+    }
+
+    /* nor if its last value or key fails the schema check */
+    jsonb_check_init(&check, &env);
+    jsonb_init(&b);
+    b.check = &check;
+    strcpy(buf, "#");
+    ASSERT_EQm(buf, JSONB_ERROR_SCHEMA,
+               jsonb_object_from_numbers(&b, buf, sizeof(buf), keys, klens,
+                                         numbers, 3));
+    ASSERT_EQ(0, b.pos);
+    ASSERT_STR_EQ("#", buf);
+    check.root = &noshell;
+    ASSERT_EQm(buf, JSONB_ERROR_SCHEMA,
+               jsonb_object_from_pairs(&b, buf, sizeof(buf), keys, klens,
+                                       vals, vlens, 3));
+    ASSERT_EQ(0, b.pos);
+    ASSERT_STR_EQ("#", buf);
+    check.root = &env;
+    ASSERT_EQm(buf, JSONB_END,
+               jsonb_object_from_pairs(&b, buf, sizeof(buf), keys, klens,
+                                       vals, vlens, 3));
+    ASSERT_STR_EQ(object, buf);
+
+    PASS();
+}
+
+TEST
+check_valid_close_all(void)
+{
+    char buf[64];
+    jsonb b;
+
+    jsonb_init(&b);
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "a", 1));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_array(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "b", 1));
+    ASSERT_EQm(buf, JSONB_END, jsonb_close_all(&b, buf, sizeof(buf)));
+    ASSERT_STR_EQ("{\"a\":[{\"b\":null}]}", buf);
+    ASSERT_EQm(buf, JSONB_END, jsonb_close_all(&b, buf, sizeof(buf)));
+
+    jsonb_init(&b);
+    ASSERT_EQm(buf, JSONB_ERROR_INPUT, jsonb_close_all(&b, buf, sizeof(buf)));
+
+    PASS();
+}
+
+TEST
+check_valid_truncate(void)
+{
+    /* "\xc3\xa9" is a 2-byte UTF-8 sequence that must not be split */
+    const char str[] = "abc\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9"
+                       "\xc3\xa9\xc3\xa9\xc3\xa9";
+    char buf[32];
+    int i;
+    jsonb b;
+
+    jsonb_init(&b);
+    b.flags |= JSONB_TRUNCATE;
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "msg", 3));
+    ASSERT_EQm(buf, JSONB_OK,
+               jsonb_string(&b, buf, sizeof(buf), str, sizeof(str) - 1));
+    ASSERT_EQ(0, b.flags & JSONB_TRUNCATED);
+    ASSERT_EQm(buf, JSONB_END, jsonb_key(&b, buf, sizeof(buf), "n", 1));
+    ASSERT(b.flags & JSONB_TRUNCATED);
+    /* further input is dropped */
+    ASSERT_EQm(buf, JSONB_END, jsonb_number(&b, buf, sizeof(buf), 1));
+    ASSERT_EQm(buf, JSONB_END, jsonb_object_pop(&b, buf, sizeof(buf)));
+    ASSERT_STR_EQ("{\"msg\":\"abc\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9"
+                  "\xc3\xa9...\"}",
+                  buf);
+
+    jsonb_init(&b);
+    b.flags |= JSONB_TRUNCATE;
+    ASSERT_EQm(buf, JSONB_OK, jsonb_array(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "values", 6));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_array(&b, buf, sizeof(buf)));
+    for (i = 0; JSONB_OK == jsonb_number(&b, buf, sizeof(buf), i); ++i)
+        continue;
+    ASSERT_STR_EQ("[{\"values\":[0,1,2,3,4,5,6,7]}]", buf);
+    ASSERT_EQm(buf, JSONB_END, jsonb_close_all(&b, buf, sizeof(buf)));
+
+    PASS();
+}
+
+TEST
+check_valid_projection(void)
+{
+    const char selector[] = "id,owner(name),items/v";
+    struct jsonb_field fields[8];
+    char buf[128];
+    jsonb b;
+
+    ASSERT_EQ(6, jsonb_fields_compile(fields, 8, selector,
+                                      sizeof(selector) - 1));
+    jsonb_init(&b);
+    b.fields = fields;
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "id", 2));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_number(&b, buf, sizeof(buf), 1));
+    ASSERT_EQ(0, jsonb_wanted(&b, "secret", 6));
+    /* the whole subtree is skipped */
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "secret", 6));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "x", 1));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_array(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_string(&b, buf, sizeof(buf), "y", 1));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_array_pop(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object_pop(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "owner", 5));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, sizeof(buf)));
+    ASSERT_EQ(0, jsonb_wanted(&b, "email", 5));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "email", 5));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_string(&b, buf, sizeof(buf), "e", 1));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "name", 4));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_string(&b, buf, sizeof(buf), "a", 1));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object_pop(&b, buf, sizeof(buf)));
+    /* keys of an array's objects */
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "items", 5));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_array(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "w", 1));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_number(&b, buf, sizeof(buf), 2));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "v", 1));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_number(&b, buf, sizeof(buf), 3));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object_pop(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_array_pop(&b, buf, sizeof(buf)));
+    ASSERT_EQ(1, jsonb_wanted(&b, "id", 2));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "extra", 5));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_null(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_END, jsonb_object_pop(&b, buf, sizeof(buf)));
+    ASSERT_STR_EQ("{\"id\":1,\"owner\":{\"name\":\"a\"},\"items\":[{\"v\":3}]}",
+                  buf);
+
+    /* escaped keys are matched by their unescaped form */
+    ASSERT_EQ(3, jsonb_fields_compile(fields, 8, "a\"b,c", 5));
+    jsonb_init(&b);
+    b.fields = fields;
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK,
+               jsonb_key_raw(&b, buf, sizeof(buf), "a\\u0022b", 8));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_number(&b, buf, sizeof(buf), 1));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key_raw(&b, buf, sizeof(buf), "c\\t", 3));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_number(&b, buf, sizeof(buf), 2));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key_raw(&b, buf, sizeof(buf), "\\c", 2));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_number(&b, buf, sizeof(buf), 3));
+    ASSERT_EQm(buf, JSONB_END, jsonb_object_pop(&b, buf, sizeof(buf)));
+    ASSERT_STR_EQ("{\"a\\u0022b\":1}", buf);
+
+    ASSERT_EQ(JSONB_ERROR_NOMEM, jsonb_fields_compile(fields, 2, "a,b", 3));
+    ASSERT_EQ(JSONB_ERROR_INPUT, jsonb_fields_compile(fields, 8, "a(b", 3));
+    ASSERT_EQ(JSONB_ERROR_INPUT, jsonb_fields_compile(fields, 8, "a,,b", 4));
+    ASSERT_EQ(JSONB_ERROR_INPUT, jsonb_fields_compile(fields, 8, "a)", 2));
+
+    PASS();
+}
+
+TEST
+check_valid_omitempty(void)
+{
+    char buf[64];
+    jsonb b;
+
+    jsonb_init(&b);
+    b.flags |= JSONB_OMITEMPTY;
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "a", 1));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_null(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "b", 1));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_number(&b, buf, sizeof(buf), 0));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "c", 1));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_string(&b, buf, sizeof(buf), "", 0));
+    /* containers left empty by omitted members are omitted too */
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "d", 1));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "e", 1));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_array(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_array_pop(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object_pop(&b, buf, sizeof(buf)));
+    ASSERT_STR_EQ("{", buf);
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "f", 1));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_number(&b, buf, sizeof(buf), 1));
+    /* array elements are kept */
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "g", 1));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_array(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_null(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_number(&b, buf, sizeof(buf), 0));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object_pop(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_array_pop(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "h", 1));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object_pop(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "i", 1));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_bool(&b, buf, sizeof(buf), 0));
+    ASSERT_EQm(buf, JSONB_END, jsonb_object_pop(&b, buf, sizeof(buf)));
+    ASSERT_STR_EQ("{\"f\":1,\"g\":[null,0,{}],\"i\":false}", buf);
+
+    jsonb_init(&b);
+    b.flags |= JSONB_OMITEMPTY;
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "a", 1));
+    ASSERT_EQm(buf, JSONB_END, jsonb_close_all(&b, buf, sizeof(buf)));
+    ASSERT_STR_EQ("{}", buf);
+
+    PASS();
+}
+
+TEST
+check_valid_memo(void)
+{
+    struct jsonb_memo_slot slots[2];
+    char arena[16], buf[64];
+    jsonb_memo memo;
+    const char *value;
+    size_t len;
+    jsonb b;
+
+    jsonb_memo_init(&memo, slots, 2, arena, sizeof(arena));
+    ASSERT_EQ(0, jsonb_memo_lookup(&memo, 1, &value, &len));
+    ASSERT_EQ(1, jsonb_memo_store(&memo, 1, "{\"a\":1}", 7));
+    ASSERT_EQ(1, jsonb_memo_store(&memo, 2, "[2]", 3));
+    ASSERT_EQ(0, jsonb_memo_store(&memo, 3, "\"too long\"", 10));
+
+    jsonb_init(&b);
+    ASSERT_EQm(buf, JSONB_OK, jsonb_array(&b, buf, sizeof(buf)));
+    ASSERT_EQ(1, jsonb_memo_lookup(&memo, 1, &value, &len));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_token(&b, buf, sizeof(buf), value, len));
+    ASSERT_EQ(1, jsonb_memo_lookup(&memo, 1, &value, &len));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_token(&b, buf, sizeof(buf), value, len));
+    ASSERT_EQm(buf, JSONB_END, jsonb_array_pop(&b, buf, sizeof(buf)));
+    ASSERT_STR_EQ("[{\"a\":1},{\"a\":1}]", buf);
+
+    /* the least recently used is evicted */
+    ASSERT_EQ(1, jsonb_memo_store(&memo, 3, "null", 4));
+    ASSERT_EQ(0, jsonb_memo_lookup(&memo, 2, &value, &len));
+    ASSERT_EQ(1, jsonb_memo_lookup(&memo, 3, &value, &len));
+    ASSERT_EQ(4, len);
+    ASSERT_EQ(3, memo.hits);
+    ASSERT_EQ(2, memo.misses);
+    ASSERT_EQ(1, memo.evictions);
+
+    PASS();
+}
+
+TEST
+check_valid_keycache(void)
+{
+    struct jsonb_keycache_slot slots[4];
+    struct jsonb_keyref a, c;
+    jsonb_keycache cache;
+    char arena[64], buf[128];
+    int i;
+    jsonb b;
+
+    jsonb_keycache_init(&cache, slots, 4, arena, sizeof(arena));
+    jsonb_keycache_ref(&cache, &a, "host", 4);
+    jsonb_keycache_ref(&cache, &c, "a\"b", 3);
+    jsonb_init(&b);
+    ASSERT_EQm(buf, JSONB_OK, jsonb_array(&b, buf, sizeof(buf)));
+    for (i = 0; i < 3; ++i) {
+        ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, sizeof(buf)));
+        ASSERT_EQm(buf, JSONB_OK,
+                   jsonb_key_ref(&b, buf, sizeof(buf), &cache, &a));
+        ASSERT_EQm(buf, JSONB_OK, jsonb_number(&b, buf, sizeof(buf), i));
+        ASSERT_EQm(buf, JSONB_OK,
+                   jsonb_key_ref(&b, buf, sizeof(buf), &cache, &c));
+        ASSERT_EQm(buf, JSONB_OK, jsonb_null(&b, buf, sizeof(buf)));
+        ASSERT_EQm(buf, JSONB_OK, jsonb_object_pop(&b, buf, sizeof(buf)));
+    }
+    ASSERT_EQm(buf, JSONB_END, jsonb_array_pop(&b, buf, sizeof(buf)));
+    ASSERT_STR_EQ("[{\"host\":0,\"a\\\"b\":null},"
+                  "{\"host\":1,\"a\\\"b\":null},"
+                  "{\"host\":2,\"a\\\"b\":null}]",
+                  buf);
+    ASSERT_EQ(0, cache.hits);
+    ASSERT_EQ(2, cache.misses);
+    ASSERT_EQ(4 + 3 + 4, cache.bytes);
+    /* a key looked up again is found in its slot */
+    jsonb_keycache_ref(&cache, &a, "host", 4);
+    ASSERT_EQ(1, cache.hits);
+
+    /* keys that don't fit a slot are escaped every time */
+    jsonb_keycache_init(&cache, slots, 1, arena, 6);
+    jsonb_keycache_ref(&cache, &a, "\n\n\n", 3);
+    jsonb_init(&b);
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key_ref(&b, buf, sizeof(buf), &cache, &a));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_null(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_END, jsonb_object_pop(&b, buf, sizeof(buf)));
+    ASSERT_STR_EQ("{\"\\n\\n\\n\":null}", buf);
+    ASSERT_EQ(1, cache.misses);
+    ASSERT_EQ(0, cache.bytes);
+
+    /* references are only looked up again once their slot is taken */
+    jsonb_keycache_init(&cache, slots, 1, arena, sizeof(arena));
+    jsonb_keycache_ref(&cache, &a, "a\"b", 3);
+    jsonb_init(&b);
+    ASSERT_EQm(buf, JSONB_OK, jsonb_array(&b, buf, sizeof(buf)));
+    for (i = 0; i < 2; ++i) {
+        ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, sizeof(buf)));
+        ASSERT_EQm(buf, JSONB_OK,
+                   jsonb_key_ref(&b, buf, sizeof(buf), &cache, &a));
+        ASSERT_EQm(buf, JSONB_OK, jsonb_number(&b, buf, sizeof(buf), i));
+        ASSERT_EQm(buf, JSONB_OK, jsonb_object_pop(&b, buf, sizeof(buf)));
+    }
+    ASSERT_EQ(0, cache.hits);
+    ASSERT_EQ(1, cache.misses);
+    jsonb_keycache_ref(&cache, &c, "c", 1);
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key_ref(&b, buf, sizeof(buf), &cache, &a));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_null(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key_ref(&b, buf, sizeof(buf), &cache, &c));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_null(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object_pop(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_END, jsonb_array_pop(&b, buf, sizeof(buf)));
+    ASSERT_STR_EQ("[{\"a\\\"b\":0},{\"a\\\"b\":1},"
+                  "{\"a\\\"b\":null,\"c\":null}]",
+                  buf);
+    ASSERT_EQ(0, cache.hits);
+    ASSERT_EQ(4, cache.misses);
+
+    PASS();
+}
+
+TEST
+check_valid_tape(void)
+{
+    char mem[256], buf[64], out[128] = { 0 };
+    size_t offset = 0;
+    jsonb_tape tape;
+    int i;
+    jsonb b;
+
+    jsonb_tape_init(&tape, mem, sizeof(mem));
+    for (i = 0; i < 2; ++i) {
+        ASSERT_EQ(JSONB_OK, jsonb_tape_record(&tape, JSONB_OP_OBJECT, 0, 0, 0));
+        ASSERT_EQ(JSONB_OK,
+                  jsonb_tape_record(&tape, JSONB_OP_KEY, "msg", 3, 0));
+        ASSERT_EQ(JSONB_OK,
+                  jsonb_tape_record(&tape, JSONB_OP_STRING, "a\"b", 3, 0));
+        ASSERT_EQ(JSONB_OK, jsonb_tape_record(&tape, JSONB_OP_KEY, "n", 1, 0));
+        ASSERT_EQ(JSONB_OK,
+                  jsonb_tape_record(&tape, JSONB_OP_NUMBER, 0, 0, i + 0.5));
+        ASSERT_EQ(JSONB_OK, jsonb_tape_record(&tape, JSONB_OP_KEY, "ok", 2, 0));
+        ASSERT_EQ(JSONB_OK, jsonb_tape_record(&tape, JSONB_OP_BOOL, 0, 0, i));
+        ASSERT_EQ(JSONB_OK,
+                  jsonb_tape_record(&tape, JSONB_OP_OBJECT_POP, 0, 0, 0));
+    }
+    ASSERT_EQ(JSONB_ERROR_INPUT,
+              jsonb_tape_record(&tape, (enum jsonbop)99, 0, 0, 0));
+
+    /* replay as NDJSON */
+    while (offset < tape.pos) {
+        jsonb_init(&b);
+        ASSERT_EQm(buf, JSONB_END,
+                   jsonb_tape_replay(&b, buf, sizeof(buf), &tape, &offset));
+        strcat(out, buf);
+        strcat(out, "\n");
+    }
+    ASSERT_STR_EQ("{\"msg\":\"a\\\"b\",\"n\":0.5,\"ok\":false}\n"
+                  "{\"msg\":\"a\\\"b\",\"n\":1.5,\"ok\":true}\n",
+                  out);
+
+    /* a full tape or buffer can be retried */
+    tape.size = tape.pos;
+    ASSERT_EQ(JSONB_ERROR_NOMEM,
+              jsonb_tape_record(&tape, JSONB_OP_NULL, 0, 0, 0));
+    jsonb_init(&b);
+    offset = 0;
+    ASSERT_EQm(buf, JSONB_ERROR_NOMEM,
+               jsonb_tape_replay(&b, buf, 8, &tape, &offset));
+    ASSERT_EQ(1 + 1 + sizeof(size_t) + 3, offset);
+
+    PASS();
+}
+
+TEST
+check_valid_exec(void)
+{
+    const struct jsonb_op ops[] = {
+        { JSONB_OP_OBJECT, NULL, 0, 0 },
+        { JSONB_OP_KEY, "list", 4, 0 },
+        { JSONB_OP_ARRAY, NULL, 0, 0 },
+        { JSONB_OP_NUMBER, NULL, 0, 1.5 },
+        { JSONB_OP_BOOL, NULL, 0, 1 },
+        { JSONB_OP_NULL, NULL, 0, 0 },
+        { JSONB_OP_STRING, "a\"b", 3, 0 },
+        { JSONB_OP_TOKEN, "{}", 2, 0 },
+        { JSONB_OP_ARRAY_POP, NULL, 0, 0 },
+        { JSONB_OP_OBJECT_POP, NULL, 0, 0 },
+    };
+    const size_t n = sizeof(ops) / sizeof *ops;
+    char buf[64];
+    jsonbcode code;
+    size_t i;
+    jsonb b;
+
+    jsonb_init(&b);
+    ASSERT_EQ(n, jsonb_exec(&b, buf, sizeof(buf), ops, n, &code));
+    ASSERT_EQ(JSONB_END, code);
+    ASSERT_STR_EQ("{\"list\":[1.5,true,null,\"a\\\"b\",{}]}", buf);
+
+    /* resume from the failing operation with a larger buffer */
+    jsonb_init(&b);
+    i = jsonb_exec(&b, buf, 16, ops, n, &code);
+    ASSERT_EQ(JSONB_ERROR_NOMEM, code);
+    ASSERT_EQ(4, i);
+    ASSERT_EQ(n - i, jsonb_exec(&b, buf, sizeof(buf), ops + i, n - i, NULL));
+    ASSERT_STR_EQ("{\"list\":[1.5,true,null,\"a\\\"b\",{}]}", buf);
+
+    /* operations past the end of the JSON fail */
+    ASSERT_EQ(0, jsonb_exec(&b, buf, sizeof(buf), ops, n, &code));
+    ASSERT(code < 0);
+
+    PASS();
+}
+
+static void
+log_sink(void *data, const char line[], size_t len)
+{
+    strncat(data, line, len);
+}
+
+static int
+log_evaluated(int *count)
+{
+    return ++*count;
+}
+
+TEST
+check_valid_log(void)
+{
+    char buf[48], out[256] = { 0 };
+    jsonb_logger logger;
+    int count = 0;
+
+    jsonb_logger_init(&logger, buf, sizeof(buf), &log_sink, out);
+    logger.level = JSONB_LOG_INFO;
+    JSONB_LOG(&logger, JSONB_LOG_DEBUG)
+    {
+        jsonb_log_number(&logger, JSONB_LOG_KEY("n"), log_evaluated(&count));
+    }
+    ASSERT_EQ(0, count);
+    JSONB_LOG(&logger, JSONB_LOG_WARN)
+    {
+        jsonb_log_string(&logger, JSONB_LOG_KEY("msg"), "a\"b", 3);
+        jsonb_log_number(&logger, JSONB_LOG_KEY("n"), log_evaluated(&count));
+        jsonb_log_bool(&logger, JSONB_LOG_KEY("ok"), 1);
+    }
+    ASSERT_EQ(1, count);
+    /* records that don't fit are cut short, but still valid */
+    JSONB_LOG(&logger, JSONB_LOG_ERROR)
+    {
+        jsonb_log_string(&logger, JSONB_LOG_KEY("msg"),
+                         "0123456789abcdefghijklmnopqrstuvwxyz", 36);
+    }
+    /* only one out of every two records */
+    logger.sample = 2;
+    JSONB_LOG(&logger, JSONB_LOG_INFO)
+    {
+        jsonb_log_number(&logger, JSONB_LOG_KEY("n"), log_evaluated(&count));
+    }
+    JSONB_LOG(&logger, JSONB_LOG_INFO)
+    {
+        jsonb_log_number(&logger, JSONB_LOG_KEY("n"), log_evaluated(&count));
+    }
+    ASSERT_EQ(2, count);
+    ASSERT_STR_EQ("{\"level\":\"warn\",\"msg\":\"a\\\"b\",\"n\":1,\"ok\":true}\n"
+                  "{\"level\":\"error\",\"msg\":\"0123456789abcdefgh...\"}\n"
+                  "{\"level\":\"info\",\"n\":2}\n",
+                  out);
+    /* every record that passed the level filter, sampled out or not */
+    ASSERT_EQ(4, logger.count);
+    /* the level is evaluated once */
+    count = 0;
+    JSONB_LOG(&logger, (enum jsonblevel)(log_evaluated(&count) - 1))
+    {
+        jsonb_log_bool(&logger, JSONB_LOG_KEY("ok"), 1);
+    }
+    ASSERT_EQ(1, count);
+
+    PASS();
+}
+
+TEST
+check_valid_schema(void)
+{
+    static const struct jsonb_schema number = { JSONB_TYPE_NUMBER, NULL, 0,
+                                                NULL, 0, 0, NULL, 0, 0 };
+    static const struct jsonb_schema tags = { JSONB_TYPE_ARRAY, NULL, 0,
+                                              NULL, 0, 0, NULL, 1, 2 };
+    static const struct jsonb_schema_member members[] = {
+        { "id", 2, &number, 1 },
+        { "tags", 4, &tags, 0 },
+        { "name", 4, NULL, 1 },
+    };
+    struct jsonb_schema root = { JSONB_TYPE_OBJECT, members, 3,
+                                 NULL, 0, 0, NULL, 0, 0 };
+    struct jsonb_check check;
+    size_t table[8];
+    char buf[64];
+    jsonb b;
+
+    ASSERT_EQ(JSONB_OK, jsonb_schema_compile(&root, table, 8));
+
+    jsonb_check_init(&check, &root);
+    jsonb_init(&b);
+    b.check = &check;
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "id", 2));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_number(&b, buf, sizeof(buf), 1));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "tags", 4));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_array(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_string(&b, buf, sizeof(buf), "a", 1));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_array_pop(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "name", 4));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_null(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_END, jsonb_object_pop(&b, buf, sizeof(buf)));
+    ASSERT_STR_EQ("{\"id\":1,\"tags\":[\"a\"],\"name\":null}", buf);
+
+    /* unknown key */
+    jsonb_check_init(&check, &root);
+    jsonb_init(&b);
+    b.check = &check;
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_ERROR_SCHEMA,
+               jsonb_key(&b, buf, sizeof(buf), "idx", 3));
+
+    /* escaped keys are matched by their unescaped form */
+    jsonb_check_init(&check, &root);
+    jsonb_init(&b);
+    b.check = &check;
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK,
+               jsonb_key_raw(&b, buf, sizeof(buf), "\\u0069d", 7));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_number(&b, buf, sizeof(buf), 1));
+    ASSERT_EQm(buf, JSONB_ERROR_SCHEMA,
+               jsonb_key_raw(&b, buf, sizeof(buf), "n\\u00e1me", 10));
+
+    /* wrong type */
+    jsonb_check_init(&check, &root);
+    jsonb_init(&b);
+    b.check = &check;
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "id", 2));
+    ASSERT_EQm(buf, JSONB_ERROR_SCHEMA,
+               jsonb_string(&b, buf, sizeof(buf), "1", 1));
+
+    /* array bounds, and missing required member */
+    jsonb_check_init(&check, &root);
+    jsonb_init(&b);
+    b.check = &check;
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "tags", 4));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_array(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_ERROR_SCHEMA,
+               jsonb_array_pop(&b, buf, sizeof(buf)));
+    jsonb_check_init(&check, &root);
+    jsonb_init(&b);
+    b.check = &check;
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "tags", 4));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_array(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_number(&b, buf, sizeof(buf), 1));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_number(&b, buf, sizeof(buf), 2));
+    ASSERT_EQm(buf, JSONB_ERROR_SCHEMA,
+               jsonb_number(&b, buf, sizeof(buf), 3));
+    jsonb_check_init(&check, &root);
+    jsonb_init(&b);
+    b.check = &check;
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "id", 2));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_number(&b, buf, sizeof(buf), 1));
+    ASSERT_EQm(buf, JSONB_ERROR_SCHEMA,
+               jsonb_object_pop(&b, buf, sizeof(buf)));
+
+    /* a required member omitted by JSONB_OMITEMPTY is missing */
+    jsonb_check_init(&check, &root);
+    jsonb_init(&b);
+    b.flags |= JSONB_OMITEMPTY;
+    b.check = &check;
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "id", 2));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_number(&b, buf, sizeof(buf), 1));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "name", 4));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_null(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_ERROR_SCHEMA,
+               jsonb_object_pop(&b, buf, sizeof(buf)));
+    jsonb_check_init(&check, &root);
+    jsonb_init(&b);
+    b.flags |= JSONB_OMITEMPTY;
+    b.check = &check;
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "id", 2));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_number(&b, buf, sizeof(buf), 1));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "name", 4));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object_pop(&b, buf, sizeof(buf)));
+    ASSERT_STR_EQ("{\"id\":1", buf);
+    ASSERT_EQm(buf, JSONB_ERROR_SCHEMA,
+               jsonb_object_pop(&b, buf, sizeof(buf)));
+
+    PASS();
+}
+
+TEST
+check_valid_run(void)
+{
+    static const struct jsonb_schema number = { JSONB_TYPE_NUMBER, NULL, 0,
+                                                NULL, 0, 0, NULL, 0, 0 };
+    static const struct jsonb_schema_member members[] = {
+        { "id", 2, &number, 1 },
+    };
+    static const struct jsonb_schema root = { JSONB_TYPE_OBJECT, members, 1,
+                                              NULL, 0, 0, NULL, 0, 0 };
+    struct jsonb_field fields[4];
+    struct jsonb_check check;
+    char buf[64];
+    size_t len;
+    jsonb b;
+
+    /* the measured length (plus NUL) is exactly enough */
+    jsonb_init(&b);
+    ASSERT_EQ(JSONB_OK, jsonb_run(&b, NULL, 0, "{\"a\":[", 6, "{:["));
+    ASSERT_EQ(JSONB_OK, jsonb_integer(&b, NULL, 0, 1));
+    ASSERT_EQ(JSONB_OK, jsonb_run(&b, NULL, 0, "],\"b\\n\":", 8, "]:"));
+    ASSERT_EQ(JSONB_OK, jsonb_null(&b, NULL, 0));
+    ASSERT_EQ(JSONB_END, jsonb_run(&b, NULL, 0, "}", 1, "}"));
+    len = b.pos;
+    jsonb_init(&b);
+    ASSERT_EQm(buf, JSONB_OK, jsonb_run(&b, buf, len + 1, "{\"a\":[", 6, "{:["));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_integer(&b, buf, len + 1, 1));
+    ASSERT_EQm(buf, JSONB_OK,
+               jsonb_run(&b, buf, len + 1, "],\"b\\n\":", 8, "]:"));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_null(&b, buf, len + 1));
+    ASSERT_EQm(buf, JSONB_END, jsonb_run(&b, buf, len + 1, "}", 1, "}"));
+    ASSERT_EQ(len, b.pos);
+    ASSERT_STR_EQ("{\"a\":[1],\"b\\n\":null}", buf);
+
+    /* the comma before the first step is written as needed */
+    jsonb_init(&b);
+    ASSERT_EQm(buf, JSONB_OK, jsonb_array(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_run(&b, buf, sizeof(buf), "{}", 2, "{}"));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_run(&b, buf, sizeof(buf), "{}", 2, "{}"));
+    ASSERT_EQm(buf, JSONB_END, jsonb_array_pop(&b, buf, sizeof(buf)));
+    ASSERT_STR_EQ("[{},{}]", buf);
+
+    /* written whole or not at all, so that it can be retried */
+    jsonb_init(&b);
+    b.flags |= JSONB_NONBLOCK;
+    ASSERT_EQm(buf, JSONB_OK, jsonb_array(&b, buf, 8));
+    ASSERT_EQm(buf, JSONB_ERROR_NOMEM,
+               jsonb_run(&b, buf, 8, "{\"abc\":", 7, "{:"));
+    ASSERT_STR_EQ("[", buf);
+    ASSERT_EQm(buf, JSONB_OK,
+               jsonb_run(&b, buf, sizeof(buf), "{\"abc\":", 7, "{:"));
+    ASSERT_STR_EQ("[{\"abc\":", buf);
+
+    /* keys that aren't projected are skipped along with their values */
+    ASSERT_EQ(2, jsonb_fields_compile(fields, 4, "a", 1));
+    jsonb_init(&b);
+    b.fields = fields;
+    ASSERT_EQm(buf, JSONB_OK,
+               jsonb_run(&b, buf, sizeof(buf), "{\"a\":", 5, "{:"));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_integer(&b, buf, sizeof(buf), 1));
+    ASSERT_EQm(buf, JSONB_OK,
+               jsonb_run(&b, buf, sizeof(buf), "\"b\":[", 5, ":["));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_integer(&b, buf, sizeof(buf), 2));
+    ASSERT_EQm(buf, JSONB_END, jsonb_run(&b, buf, sizeof(buf), "]}", 2, "]}"));
+    ASSERT_STR_EQ("{\"a\":1}", buf);
+
+    /* empty members are retracted, the next key's comma along with them */
+    jsonb_init(&b);
+    b.flags |= JSONB_OMITEMPTY;
+    ASSERT_EQm(buf, JSONB_OK,
+               jsonb_run(&b, buf, sizeof(buf), "{\"a\":[", 6, "{:["));
+    ASSERT_EQm(buf, JSONB_OK,
+               jsonb_run(&b, buf, sizeof(buf), "],\"b\":", 6, "]:"));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_integer(&b, buf, sizeof(buf), 3));
+    ASSERT_EQm(buf, JSONB_END, jsonb_run(&b, buf, sizeof(buf), "}", 1, "}"));
+    ASSERT_STR_EQ("{\"b\":3}", buf);
+
+    /* nothing is written if a step fails the schema check */
+    jsonb_check_init(&check, &root);
+    jsonb_init(&b);
+    b.check = &check;
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_ERROR_SCHEMA,
+               jsonb_run(&b, buf, sizeof(buf), "\"id\":[", 6, ":["));
+    ASSERT_STR_EQ("{", buf);
+
+    /* steps that the state or the previous steps don't allow */
+    jsonb_init(&b);
+    ASSERT_EQm(buf, JSONB_ERROR_INPUT,
+               jsonb_run(&b, buf, sizeof(buf), "\"a\":", 4, ":"));
+    jsonb_init(&b);
+    ASSERT_EQm(buf, JSONB_ERROR_INPUT,
+               jsonb_run(&b, buf, sizeof(buf), "{]", 2, "{]"));
+
+    PASS();
+}
+
+TEST
+check_valid_integer(void)
+{
+    char buf[64], expect[64];
+    jsonb b;
+
+    jsonb_init(&b);
+    ASSERT_EQm(buf, JSONB_OK, jsonb_array(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_integer(&b, buf, sizeof(buf), LONG_MIN));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_integer(&b, buf, sizeof(buf), -7));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_integer(&b, buf, sizeof(buf), 0));
+    ASSERT_EQm(buf, JSONB_OK,
+               jsonb_unsigned(&b, buf, sizeof(buf), ULONG_MAX));
+    ASSERT_EQm(buf, JSONB_END, jsonb_array_pop(&b, buf, sizeof(buf)));
+    sprintf(expect, "[%ld,-7,0,%lu]", LONG_MIN, ULONG_MAX);
+    ASSERT_STR_EQ(expect, buf);
+
+    /* zeros are empty, as with jsonb_number() */
+    jsonb_init(&b);
+    b.flags |= JSONB_OMITEMPTY;
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "a", 1));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_integer(&b, buf, sizeof(buf), 0));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "b", 1));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_unsigned(&b, buf, sizeof(buf), 0));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "c", 1));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_integer(&b, buf, sizeof(buf), 10));
+    ASSERT_EQm(buf, JSONB_END, jsonb_object_pop(&b, buf, sizeof(buf)));
+    ASSERT_STR_EQ("{\"c\":10}", buf);
+
+    PASS();
+}
+
 SUITE(valid_output)
 {
     RUN_TEST(check_valid_singles);
     RUN_TEST(check_valid_array);
     RUN_TEST(check_valid_object);
+    RUN_TEST(check_valid_measure);
+    RUN_TEST(check_valid_array_extend);
+    RUN_TEST(check_valid_numbers);
+    RUN_TEST(check_valid_stitch);
+    RUN_TEST(check_valid_table);
+    RUN_TEST(check_valid_object_from_pairs);
+    RUN_TEST(check_valid_close_all);
+    RUN_TEST(check_valid_truncate);
+    RUN_TEST(check_valid_projection);
+    RUN_TEST(check_valid_omitempty);
+    RUN_TEST(check_valid_memo);
+    RUN_TEST(check_valid_keycache);
+    RUN_TEST(check_valid_tape);
+    RUN_TEST(check_valid_exec);
+    RUN_TEST(check_valid_log);
+    RUN_TEST(check_valid_schema);
+    RUN_TEST(check_valid_run);
+    RUN_TEST(check_valid_integer);
 }
 
 TEST
@@ -200,6 +1265,262 @@ SUITE(nesting)
     RUN_TEST(check_deep_nesting_object_and_array);
 }
 
+TEST
+check_string_time_sliced(void)
+{
+    const char str[] = "long \"status\"\n\1 value, long \"status\"\n value";
+    char buf[256], expect[256];
+    size_t prev_pos;
+    enum jsonbcode code;
+    int calls = 0;
+    jsonb b;
+
+    jsonb_init(&b);
+    ASSERT_EQm(buf, JSONB_OK, jsonb_array(&b, expect, sizeof(expect)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_null(&b, expect, sizeof(expect)));
+    ASSERT_EQm(buf, JSONB_OK,
+               jsonb_string(&b, expect, sizeof(expect), str, sizeof(str) - 1));
+
+    jsonb_init(&b);
+    b.flags |= JSONB_NONBLOCK;
+    ASSERT_EQm(buf, JSONB_OK, jsonb_array(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_null(&b, buf, sizeof(buf)));
+    do {
+        prev_pos = b.pos;
+        code = jsonb_string(&b, buf, jsonb_slice(&b, sizeof(buf), 3), str,
+                            sizeof(str) - 1);
+        ASSERT_LTEm("wrote more than the slice", b.pos - prev_pos, 3);
+        ++calls;
+    } while (JSONB_ERROR_WOULDBLOCK == code);
+    ASSERT_EQ(JSONB_OK, code);
+    ASSERT(calls > 10);
+    ASSERT_STR_EQ(expect, buf);
+
+    PASS();
+}
+
+TEST
+check_string_chunked(void)
+{
+    const char str[] = "long \"status\"\n\1 value, long \"status\"\n value";
+    const size_t len = sizeof(str) - 1, chunk = 7;
+    char buf[256], expect[256], escaped[256];
+    size_t offsets[sizeof(str) / 7 + 2] = { 0 }, i;
+    jsonb b;
+
+    jsonb_init(&b);
+    ASSERT_EQm(expect, JSONB_END,
+               jsonb_string(&b, expect, sizeof(expect), str, len));
+
+    /* measure every chunk, place it by prefix sum, then escape in place */
+    for (i = 0; i * chunk < len; ++i) {
+        size_t n = len - i * chunk < chunk ? len - i * chunk : chunk;
+        offsets[i + 1] = offsets[i] + jsonb_escaped_len(str + i * chunk, n);
+    }
+    ASSERT_EQ(jsonb_escaped_len(str, len), offsets[i]);
+    for (i = 0; i * chunk < len; ++i) {
+        size_t n = len - i * chunk < chunk ? len - i * chunk : chunk;
+        ASSERT_EQ(offsets[i + 1] - offsets[i],
+                  jsonb_escape(escaped + offsets[i], str + i * chunk, n));
+    }
+    jsonb_init(&b);
+    ASSERT_EQm(buf, JSONB_END,
+               jsonb_string_raw(&b, buf, sizeof(buf), escaped, offsets[i]));
+    ASSERT_STR_EQ(expect, buf);
+
+    /* truncation doesn't split escape sequences */
+    jsonb_init(&b);
+    b.flags |= JSONB_TRUNCATE;
+    ASSERT_EQm(buf, JSONB_END,
+               jsonb_string_raw(&b, buf, 12, escaped, offsets[i]));
+    ASSERT_STR_EQ("\"long " JSONB_TRUNCATE_MARKER "\"", buf);
+
+    /* the same, split between threads */
+    for (i = 1; i <= 8; ++i) {
+        jsonb_init(&b);
+        ASSERT_EQm(buf, JSONB_OK, jsonb_array(&b, buf, sizeof(buf)));
+        ASSERT_EQm(buf, JSONB_OK, jsonb_null(&b, buf, sizeof(buf)));
+        ASSERT_EQm(buf, JSONB_OK,
+                   jsonb_string_threads(&b, buf, sizeof(buf), str, len,
+                                        (int)i));
+        ASSERT_EQm(buf, JSONB_END, jsonb_array_pop(&b, buf, sizeof(buf)));
+        ASSERT_MEM_EQ("[null,", buf, 6);
+        ASSERT_MEM_EQ(expect, buf + 6, strlen(expect));
+        ASSERT_STR_EQ("]", buf + 6 + strlen(expect));
+    }
+    /* lack of room is left to jsonb_string() */
+    memset(buf, '#', sizeof(buf));
+    jsonb_init(&b);
+    ASSERT_EQm(buf, JSONB_ERROR_NOMEM,
+               jsonb_string_threads(&b, buf, strlen(expect), str, len, 4));
+    for (i = strlen(expect); i < sizeof(buf); ++i)
+        ASSERT_EQm("wrote past bufsize", '#', buf[i]);
+    /* as are short strings */
+    jsonb_init(&b);
+    ASSERT_EQm(buf, JSONB_END,
+               jsonb_string_threads(&b, buf, sizeof(buf), "\tab", 3, 4));
+    ASSERT_STR_EQ("\"\\tab\"", buf);
+
+    PASS();
+}
+
+TEST
+check_save_and_load(void)
+{
+    const char expect[] = "{\"rows\":[{\"id\":1},{\"id\":2}],\"done\":true}";
+    char buf[128], dest[128] = { 0 }, state[JSONB_SAVE_MAX];
+    struct jsonb_field fields[4];
+    struct jsonb_check check;
+    size_t len;
+    jsonb b;
+
+    jsonb_init(&b);
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "rows", 4));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_array(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "id", 2));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_number(&b, buf, sizeof(buf), 1));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object_pop(&b, buf, sizeof(buf)));
+    /* checkpoint: flush output and persist the state along with it */
+    strcat(dest, buf);
+    jsonb_reset(&b);
+    ASSERT_EQ(0, jsonb_save(&b, state, JSONB_SAVE_HEADER));
+    len = jsonb_save(&b, state, sizeof(state));
+    ASSERT(len > JSONB_SAVE_HEADER && len <= sizeof(state));
+
+    /* resume as if from a new process */
+    memset(&b, 0xFF, sizeof(b));
+    ASSERT_EQ(JSONB_ERROR_INPUT, jsonb_load(&b, state, len - 1));
+    ASSERT_EQ(JSONB_OK, jsonb_load(&b, state, len));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "id", 2));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_number(&b, buf, sizeof(buf), 2));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object_pop(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_array_pop(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "done", 4));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_bool(&b, buf, sizeof(buf), 1));
+    ASSERT_EQm(buf, JSONB_END, jsonb_object_pop(&b, buf, sizeof(buf)));
+    strcat(dest, buf);
+    ASSERT_STR_EQ(expect, dest);
+
+    state[0] = JSONB_SAVE_VERSION + 1;
+    ASSERT_EQ(JSONB_ERROR_INPUT, jsonb_load(&b, state, len));
+
+    /* a key restored under JSONB_OMITEMPTY is still retracted */
+    jsonb_init(&b);
+    b.flags |= JSONB_OMITEMPTY;
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "a", 1));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_number(&b, buf, sizeof(buf), 1));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "bbbb", 4));
+    len = jsonb_save(&b, state, sizeof(state));
+    memset(&b, 0xFF, sizeof(b));
+    ASSERT_EQ(JSONB_OK, jsonb_load(&b, state, len));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_null(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "c", 1));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_null(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_END, jsonb_object_pop(&b, buf, sizeof(buf)));
+    ASSERT_STR_EQ("{\"a\":1}", buf);
+
+    /* so is a value being skipped by a projection */
+    ASSERT_EQ(2, jsonb_fields_compile(fields, 4, "a", 1));
+    jsonb_init(&b);
+    b.fields = fields;
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "b", 1));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "c", 1));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_number(&b, buf, sizeof(buf), 1));
+    len = jsonb_save(&b, state, sizeof(state));
+    memset(&b, 0xFF, sizeof(b));
+    ASSERT_EQ(JSONB_OK, jsonb_load(&b, state, len));
+    b.fields = fields;
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "d", 1));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_number(&b, buf, sizeof(buf), 2));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object_pop(&b, buf, sizeof(buf)));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, sizeof(buf), "a", 1));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_number(&b, buf, sizeof(buf), 1));
+    ASSERT_EQm(buf, JSONB_END, jsonb_object_pop(&b, buf, sizeof(buf)));
+    ASSERT_STR_EQ("{\"a\":1}", buf);
+
+    /* a schema check's state isn't saved */
+    jsonb_check_init(&check, NULL);
+    jsonb_init(&b);
+    b.check = &check;
+    ASSERT_EQ(0, jsonb_save(&b, state, sizeof(state)));
+
+    PASS();
+}
+
+TEST
+check_save_and_load_anywhere(void)
+{
+    const struct jsonb_op ops[] = {
+        { JSONB_OP_OBJECT, NULL, 0, 0 },
+        { JSONB_OP_KEY, "id", 2, 0 },
+        { JSONB_OP_NUMBER, NULL, 0, 1 },
+        { JSONB_OP_KEY, "skipped", 7, 0 },
+        { JSONB_OP_OBJECT, NULL, 0, 0 },
+        { JSONB_OP_KEY, "deep", 4, 0 },
+        { JSONB_OP_ARRAY, NULL, 0, 0 },
+        { JSONB_OP_NUMBER, NULL, 0, 2 },
+        { JSONB_OP_ARRAY_POP, NULL, 0, 0 },
+        { JSONB_OP_OBJECT_POP, NULL, 0, 0 },
+        { JSONB_OP_KEY, "owner", 5, 0 },
+        { JSONB_OP_OBJECT, NULL, 0, 0 },
+        { JSONB_OP_KEY, "meta", 4, 0 },
+        { JSONB_OP_OBJECT, NULL, 0, 0 },
+        { JSONB_OP_KEY, "tags", 4, 0 },
+        { JSONB_OP_ARRAY, NULL, 0, 0 },
+        { JSONB_OP_ARRAY_POP, NULL, 0, 0 },
+        { JSONB_OP_OBJECT_POP, NULL, 0, 0 },
+        { JSONB_OP_KEY, "mail", 4, 0 },
+        { JSONB_OP_STRING, "m", 1, 0 },
+        { JSONB_OP_KEY, "name", 4, 0 },
+        { JSONB_OP_STRING, "a", 1, 0 },
+        { JSONB_OP_KEY, "nil", 3, 0 },
+        { JSONB_OP_NULL, NULL, 0, 0 },
+        { JSONB_OP_OBJECT_POP, NULL, 0, 0 },
+        { JSONB_OP_KEY, "tags", 4, 0 },
+        { JSONB_OP_ARRAY, NULL, 0, 0 },
+        { JSONB_OP_ARRAY_POP, NULL, 0, 0 },
+        { JSONB_OP_OBJECT_POP, NULL, 0, 0 },
+    };
+    const char selector[] = "id,owner(name,nil,meta(tags)),tags";
+    const size_t n = sizeof(ops) / sizeof *ops;
+    char buf[128], state[JSONB_SAVE_MAX];
+    struct jsonb_field fields[16];
+    size_t i, len;
+    jsonb b;
+
+    ASSERT(jsonb_fields_compile(fields, 16, selector, sizeof(selector) - 1)
+           > 0);
+    /* a checkpoint taken between any two calls, mid-projection and
+     *      mid-omit, resumes to the same output */
+    for (i = 0; i <= n; ++i) {
+        jsonb_init(&b);
+        b.flags |= JSONB_OMITEMPTY;
+        b.fields = fields;
+        ASSERT_EQ(i, jsonb_exec(&b, buf, sizeof(buf), ops, i, NULL));
+        len = jsonb_save(&b, state, sizeof(state));
+        ASSERT(len >= JSONB_SAVE_HEADER && len <= sizeof(state));
+        memset(&b, 0xFF, sizeof(b));
+        ASSERT_EQ(JSONB_OK, jsonb_load(&b, state, len));
+        b.fields = fields;
+        ASSERT_EQ(n - i,
+                  jsonb_exec(&b, buf, sizeof(buf), ops + i, n - i, NULL));
+        ASSERTm(buf, *b.top == JSONB_DONE);
+        ASSERT_STR_EQ("{\"id\":1,\"owner\":{\"name\":\"a\"}}", buf);
+    }
+
+    /* a state of another version is rejected, rather than misread */
+    state[0] = JSONB_SAVE_VERSION - 1;
+    ASSERT_EQ(JSONB_ERROR_INPUT, jsonb_load(&b, state, len));
+
+    PASS();
+}
+
 TEST
 check_string_escaping(void)
 {
@@ -304,10 +1625,99 @@ check_string_streaming(void)
     PASS();
 }
 
+TEST
+check_string_nonblock(void)
+{
+    const char expect[] = "{\"key\\n\":[\"a \\\"quoted\\\" \\u0001 str\","
+                          "1,true],\"\":{}}";
+    char buf[4], dest[1024] = { 0 };
+    enum jsonbcode code;
+    jsonb b;
+
+#define NONBLOCK(call)                                                        \
+    do {                                                                      \
+        while (JSONB_ERROR_WOULDBLOCK == (code = (call))) {                   \
+            strcat(dest, buf);                                                \
+            jsonb_reset(&b);                                                  \
+        }                                                                     \
+        ASSERT_GTEm(buf, code, 0);                                            \
+    } while (0)
+
+    jsonb_init(&b);
+    b.flags |= JSONB_NONBLOCK;
+    NONBLOCK(jsonb_object(&b, buf, sizeof(buf)));
+    NONBLOCK(jsonb_key(&b, buf, sizeof(buf), "key\n", 4));
+    NONBLOCK(jsonb_array(&b, buf, sizeof(buf)));
+    NONBLOCK(jsonb_string(&b, buf, sizeof(buf), "a \"quoted\" \1 str", 16));
+    NONBLOCK(jsonb_number(&b, buf, sizeof(buf), 1));
+    NONBLOCK(jsonb_bool(&b, buf, sizeof(buf), 1));
+    NONBLOCK(jsonb_array_pop(&b, buf, sizeof(buf)));
+    NONBLOCK(jsonb_key(&b, buf, sizeof(buf), "", 0));
+    NONBLOCK(jsonb_object(&b, buf, sizeof(buf)));
+    NONBLOCK(jsonb_object_pop(&b, buf, sizeof(buf)));
+    NONBLOCK(jsonb_object_pop(&b, buf, sizeof(buf)));
+    ASSERT_EQ(JSONB_END, code);
+    strcat(dest, buf);
+
+#undef NONBLOCK
+
+    ASSERT_STR_EQ(expect, dest);
+
+    PASS();
+}
+
+TEST
+check_string_unterminated_pages(void)
+{
+    const char expect[] = "[\"0123456789\",\"\\tabcdef\",{\"k\":null}]";
+    char page[8], dest[1024];
+    size_t len = 0;
+    enum jsonbcode code;
+    jsonb b;
+
+#define PAGED(call)                                                           \
+    do {                                                                      \
+        while (JSONB_ERROR_WOULDBLOCK == (code = (call))) {                   \
+            ASSERT_EQm("page must be filled up", sizeof(page), b.pos);        \
+            memcpy(dest + len, page, b.pos);                                  \
+            len += b.pos;                                                     \
+            jsonb_reset(&b);                                                  \
+        }                                                                     \
+        ASSERT_GTE(code, 0);                                                  \
+    } while (0)
+
+    jsonb_init(&b);
+    b.flags |= JSONB_NONBLOCK | JSONB_UNTERMINATED;
+    PAGED(jsonb_array(&b, page, sizeof(page)));
+    PAGED(jsonb_string(&b, page, sizeof(page), "0123456789", 10));
+    PAGED(jsonb_string(&b, page, sizeof(page), "\tabcdef", 7));
+    PAGED(jsonb_object(&b, page, sizeof(page)));
+    PAGED(jsonb_key(&b, page, sizeof(page), "k", 1));
+    PAGED(jsonb_null(&b, page, sizeof(page)));
+    PAGED(jsonb_object_pop(&b, page, sizeof(page)));
+    PAGED(jsonb_array_pop(&b, page, sizeof(page)));
+    ASSERT_EQ(JSONB_END, code);
+    memcpy(dest + len, page, b.pos);
+    len += b.pos;
+
+#undef PAGED
+
+    ASSERT_EQ(sizeof(expect) - 1, len);
+    ASSERT_MEM_EQ(expect, dest, len);
+
+    PASS();
+}
+
 SUITE(string)
 {
     RUN_TEST(check_string_escaping);
     RUN_TEST(check_string_streaming);
+    RUN_TEST(check_string_nonblock);
+    RUN_TEST(check_string_unterminated_pages);
+    RUN_TEST(check_string_time_sliced);
+    RUN_TEST(check_string_chunked);
+    RUN_TEST(check_save_and_load);
+    RUN_TEST(check_save_and_load_anywhere);
 }
 
 TEST
@@ -355,6 +1765,97 @@ check_not_enough_buffer_memory(void)
     PASS();
 }
 
+TEST
+check_no_write_past_bufsize(void)
+{
+    char buf[32];
+    size_t i;
+    jsonb b;
+
+    memset(buf, '#', sizeof(buf));
+    jsonb_init(&b);
+    ASSERT_EQm(buf, JSONB_OK, jsonb_array(&b, buf, 10));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_string(&b, buf, 10, "abc", 3));
+    /* escaped output would only fit if compared against the whole buffer */
+    ASSERT_EQm(buf, JSONB_ERROR_NOMEM,
+               jsonb_string(&b, buf, 10, "\n\n\n", 3));
+    for (i = 10; i < sizeof(buf); ++i)
+        ASSERT_EQm("wrote past bufsize", '#', buf[i]);
+    ASSERT_STR_EQ("[\"abc\"", buf);
+
+    jsonb_init(&b);
+    ASSERT_EQm(buf, JSONB_OK, jsonb_object(&b, buf, 12));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_key(&b, buf, 8, "a", 1));
+    ASSERT_EQm(buf, JSONB_OK, jsonb_null(&b, buf, 12));
+    ASSERT_EQm(buf, JSONB_ERROR_NOMEM, jsonb_key(&b, buf, 8, "\t\t", 2));
+    for (i = 12; i < sizeof(buf); ++i)
+        ASSERT_EQm("wrote past bufsize", '#', buf[i]);
+    ASSERT_STR_EQ("{\"a\":null", buf);
+
+    buf[0] = '#';
+    jsonb_init(&b);
+    ASSERT_EQm(buf, JSONB_ERROR_NOMEM, jsonb_null(&b, buf, 0));
+    ASSERT_EQm("wrote past bufsize", '#', buf[0]);
+
+    PASS();
+}
+
+/* each call's code, so that builders can be compared */
+static void
+build_fast_path_document(jsonb *b, char buf[], size_t size, int codes[])
+{
+    int n = 0;
+    codes[n++] = jsonb_array(b, buf, size);
+    codes[n++] = jsonb_object(b, buf, size);
+    codes[n++] = jsonb_key(b, buf, size, "a\"b", 3);
+    codes[n++] = jsonb_string(b, buf, size, "x\ny", 3);
+    codes[n++] = jsonb_key_raw(b, buf, size, "r\\n", 3);
+    codes[n++] = jsonb_number(b, buf, size, 1.5);
+    codes[n++] = jsonb_key(b, buf, size, "k", 1);
+    codes[n++] = jsonb_bool(b, buf, size, 1);
+    codes[n++] = jsonb_object_pop(b, buf, size);
+    codes[n++] = jsonb_array(b, buf, size);
+    codes[n++] = jsonb_null(b, buf, size);
+    codes[n++] = jsonb_array_pop(b, buf, size);
+    codes[n++] = jsonb_string_raw(b, buf, size, "q\\t", 3);
+    codes[n++] = jsonb_run(b, buf, size, "{\"i\":[", 6, "{:[");
+    codes[n++] = jsonb_integer(b, buf, size, -12);
+    codes[n++] = jsonb_unsigned(b, buf, size, 0);
+    codes[n++] = jsonb_run(b, buf, size, "],\"\\\"\":", 7, "]:");
+    codes[n++] = jsonb_null(b, buf, size);
+    codes[n++] = jsonb_run(b, buf, size, "}", 1, "}");
+    codes[n++] = jsonb_array_pop(b, buf, size);
+}
+
+TEST
+check_fast_path_matches(void)
+{
+    char fast[96], slow[96];
+    int fast_codes[20], slow_codes[20];
+    struct jsonb_check check;
+    size_t size;
+    jsonb b;
+
+    /* a schema check that accepts anything keeps the general path */
+    for (size = 0; size <= sizeof(fast); ++size) {
+        memset(fast, '#', sizeof(fast));
+        memset(slow, '#', sizeof(slow));
+        jsonb_init(&b);
+        build_fast_path_document(&b, fast, size, fast_codes);
+        jsonb_init(&b);
+        jsonb_check_init(&check, NULL);
+        b.check = &check;
+        build_fast_path_document(&b, slow, size, slow_codes);
+        ASSERT_MEM_EQ(slow_codes, fast_codes, sizeof(fast_codes));
+        ASSERT_MEM_EQ(slow, fast, sizeof(fast));
+    }
+    ASSERT_STR_EQ("[{\"a\\\"b\":\"x\\ny\",\"r\\n\":1.5,\"k\":true},[null],"
+                  "\"q\\t\",{\"i\":[-12,0],\"\\\"\":null}]",
+                  fast);
+
+    PASS();
+}
+
 TEST
 check_out_of_bounds_access(void)
 {
@@ -414,6 +1915,8 @@ SUITE(force_error)
 {
     RUN_TEST(check_invalid_top_level_tokens_in_sequence);
     RUN_TEST(check_not_enough_buffer_memory);
+    RUN_TEST(check_no_write_past_bufsize);
+    RUN_TEST(check_fast_path_matches);
     RUN_TEST(check_out_of_bounds_access);
     RUN_TEST(check_single_no_operation_after_done);
     RUN_TEST(check_array_no_operation_after_done);
@@ -0,0 +1,189 @@
+#include <string>
+#include <vector>
+
+#include "json-build.hpp"
+
+#include "greatest.h"
+
+static json_build::generator
+render(const std::vector<int> &v, std::string_view name)
+{
+    co_await json_build::object();
+    co_await json_build::key("name");
+    co_await json_build::string(name);
+    co_await json_build::key("values");
+    co_await json_build::array();
+    for (int n : v)
+        co_await json_build::number(n);
+    co_await json_build::array_pop();
+    co_await json_build::key("ok");
+    co_await json_build::boolean(true);
+    co_await json_build::object_pop();
+}
+
+TEST
+check_generator_pull(void)
+{
+    const std::vector<int> v = { 1, 22, 333 };
+    const std::string expect =
+        "{\"name\":\"a \\\"long\\\" name\\n\",\"values\":[1,22,333],\"ok\":true}";
+    char window[5];
+    std::string dest;
+
+    json_build::generator gen = render(v, "a \"long\" name\n");
+    while (!gen.done()) {
+        std::span<char> chunk = gen.next(window);
+        if (!gen.done()) ASSERT_EQm("window must be filled up", 5, chunk.size());
+        dest.append(chunk.data(), chunk.size());
+    }
+    ASSERT_EQ(expect, dest);
+    ASSERT_EQ(0, gen.next(window).size());
+
+    PASS();
+}
+
+TEST
+check_generator_large_window(void)
+{
+    const std::vector<int> v = { 1, 2 };
+    char window[1024];
+
+    json_build::generator gen = render(v, "x");
+    std::span<char> chunk = gen.next(window);
+    ASSERT(gen.done());
+    ASSERT_EQ(std::string("{\"name\":\"x\",\"values\":[1,2],\"ok\":true}"),
+              std::string(chunk.data(), chunk.size()));
+
+    PASS();
+}
+
+TEST
+check_generator_empty_window(void)
+{
+    const std::vector<int> v = { 1 };
+    char window[1];
+
+    /* an empty window would never make progress */
+    json_build::generator gen = render(v, "x");
+    try {
+        gen.next(std::span<char>());
+        FAILm("empty window accepted");
+    } catch (const std::invalid_argument &) {
+    }
+    ASSERT(!gen.done());
+    ASSERT_EQ(1, gen.next(window).size());
+    ASSERT_EQ('{', window[0]);
+
+    PASS();
+}
+
+static json_build::generator
+render_invalid(bool &resumed)
+{
+    co_await json_build::array();
+    co_await json_build::number(1);
+    co_await json_build::key("k");
+    resumed = true;
+    co_await json_build::array_pop();
+}
+
+TEST
+check_generator_error(void)
+{
+    char window[64];
+    bool resumed = false;
+
+    /* the first error stops the generator, every pull throws it */
+    json_build::generator gen = render_invalid(resumed);
+    for (int i = 0; i < 2; ++i) {
+        try {
+            gen.next(window);
+            FAILm("invalid JSON pulled");
+        } catch (const json_build::error &e) {
+            ASSERT_EQ(JSONB_ERROR_INPUT, e.code);
+        }
+    }
+    ASSERT(!resumed);
+    ASSERT(!gen.done());
+
+    PASS();
+}
+
+SUITE(generator)
+{
+    RUN_TEST(check_generator_pull);
+    RUN_TEST(check_generator_large_window);
+    RUN_TEST(check_generator_empty_window);
+    RUN_TEST(check_generator_error);
+}
+
+static constexpr auto error_body = json_build::render<[](auto &b) {
+    b.object();
+    b.key("error");
+    b.string("not \"found\"\n");
+    b.key("code");
+    b.integer(-404);
+    b.key("retry");
+    b.array();
+    b.boolean(false);
+    b.null();
+    b.token("0.5");
+    b.array_pop();
+    b.object_pop();
+}>();
+
+/* rendered at compile time, to the exact size */
+static_assert(json_build::view(error_body)
+              == "{\"error\":\"not \\\"found\\\"\\n\",\"code\":-404,"
+                 "\"retry\":[false,null,0.5]}");
+static_assert(error_body.size() == json_build::view(error_body).size());
+
+TEST
+check_static_splice(void)
+{
+    char buf[128];
+    jsonb b;
+
+    /* mixed with runtime values */
+    jsonb_init(&b);
+    ASSERT_EQ(JSONB_OK, jsonb_array(&b, buf, sizeof(buf)));
+    ASSERT_EQ(JSONB_OK, jsonb_number(&b, buf, sizeof(buf), 1));
+    ASSERT_EQ(JSONB_OK, jsonb_token(&b, buf, sizeof(buf), error_body.data(),
+                                    error_body.size()));
+    ASSERT_EQ(JSONB_END, jsonb_array_pop(&b, buf, sizeof(buf)));
+    ASSERT_EQ(std::string("[1,") + std::string(json_build::view(error_body))
+                  + "]",
+              std::string(buf));
+
+    /* invalid documents are rejected the same way at runtime */
+    json_build::static_builder sb;
+    sb.object();
+    bool thrown = false;
+    try {
+        sb.string("no key");
+    }
+    catch (const std::logic_error &) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+
+    PASS();
+}
+
+SUITE(static_render)
+{
+    RUN_TEST(check_static_splice);
+}
+
+GREATEST_MAIN_DEFS();
+
+int
+main(int argc, char *argv[])
+{
+    GREATEST_MAIN_BEGIN();
+
+    RUN_SUITE(generator);
+    RUN_SUITE(static_render);
+
+    GREATEST_MAIN_END();
+}